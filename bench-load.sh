@@ -0,0 +1,22 @@
+#!/bin/sh
+# Benchmark loading timers from RDB: creates `timers` one-time timers, then for each `load-scheduling`
+# reloads them with DEBUG RELOAD and reports the loaded timers per second, RDB decode and scheduling included.
+# Needs a redis-server with the module loaded and `enable-debug-command` allowed, its db is flushed.
+# Usage: ./bench-load.sh [timers] [redis-cli options ...]
+set -e
+timers=${1:-1000000}
+[ $# -gt 0 ] && shift
+redis-cli "$@" FLUSHALL >/dev/null
+# deadlines an hour away spread over a minute, none fires while benchmarking
+awk -v n="$timers" 'BEGIN { for (i = 0; i < n; i++) printf "TIMER.NEW bench:%d f %d 0\r\n", i, 3600000 + i % 60000 }' |
+    redis-cli "$@" --pipe >/dev/null
+redis-cli "$@" SAVE >/dev/null
+for mode in per-timer one-pass; do
+    redis-cli "$@" TIMER.CONFIG SET load-scheduling "$mode" >/dev/null
+    start=$(date +%s%N)
+    redis-cli "$@" DEBUG RELOAD NOSAVE >/dev/null
+    end=$(date +%s%N)
+    loaded=$(redis-cli "$@" DBSIZE)
+    echo "$mode: $loaded timers loaded in $(( (end - start) / 1000000 )) ms, $(( loaded * 1000000000 / (end - start) )) timers/s"
+done
+redis-cli "$@" TIMER.CONFIG SET load-scheduling one-pass >/dev/null
@@ -1,33 +1,1141 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
 
 #define REDISMODULE_EXPERIMENTAL_API
 #include "redismodule.h"
 
 
-/* structure with timer information */
+typedef struct TimerList TimerList;
+
+/* what to do when a timer fires */
+typedef enum TimerAction {
+    ACTION_FCALL = 0,   /* FCALL function numkeys data... */
+    ACTION_COMMAND,     /* run `function` as a redis command with data as arguments, no lua involved */
+    ACTION_STREAM,      /* append data as field value pairs to stream `function` */
+    ACTION_POLL,        /* wait in queue `function` to be taken by TIMER.POLL */
+    ACTION_BATCH,       /* FCALL function once for all the batch timers of it fired in a tick */
+} TimerAction;
+
+/* how a loop timer is rescheduled */
+typedef enum TimerRate {
+    RATE_NONE = 0,      /* fixed delay, `interval` after it fired */
+    RATE_SKIP,          /* fixed rate, `interval` after its deadline, missed periods are skipped */
+    RATE_BURST,         /* fixed rate, missed periods are fired one after another to catch up */
+} TimerRate;
+
+/* structure with timer information, strings are packed into `payload` of the same allocation */
 typedef struct TimerData {
-    RedisModuleString *key;        /* timer key */
-    RedisModuleString *function;    /* function for the timer to execute */
+    struct TimerData *prev, *next;  /* links in the wheel slot */
+    TimerList *list;            /* list the timer is linked in, NULL if not scheduled */
+    mstime_t expire;            /* deadline, monotonic milliseconds */
     mstime_t interval;          /* interval */
     int datalen;   /* data length */
     int numkeys;     /* function numkeys */
+    int dbid;       /* key's dbid */
     bool loop;                   /* loop timer */
-    bool deleted;              /* timer key been deleted from db */
-    int dbid;       /* key's dbid, -1 if timer's dbid is the same with key's */
-    RedisModuleTimerID tid;     /* internal id for the timer API */
-    RedisModuleString *data[];  /* function keys & args */
+    bool deleted;              /* timer key been deleted from db, unscheduled and waiting to be freed */
+    uint8_t action;            /* TimerAction */
+    uint8_t ext;               /* bitmap of optional fields at the end of payload */
+    uint8_t rate;              /* TimerRate of a loop timer */
+    size_t size;    /* payload size */
+    char payload[]; /* length prefixed key, function, function keys & args, then optional fields */
 } TimerData;
 
+/* index of strings in the payload, data[i] is at PAYLOAD_DATA+i */
+#define PAYLOAD_KEY 0
+#define PAYLOAD_FUNCTION 1
+#define PAYLOAD_DATA 2
+
+/* optional int64 fields, only timers using them pay for the space, in order of the bits */
+enum {
+    EXT_MAXLEN = 0,     /* stream length to trim to after appending, negative if approximate */
+    EXT_SLACK,          /* milliseconds the timer may fire late, to share a wake-up with others */
+    EXT_OWNER,          /* TimerSet the timer is a member of, its key field is then the member name */
+    EXT_TIMES,          /* fires left of a loop timer, it's deleted after the last one */
+    EXT_JITTER,         /* max milliseconds a deadline is delayed by, overriding the `jitter` config */
+    EXT_HASH,           /* hash of the key fixing the jitter offset, not to hash the key per deadline, not saved */
+    EXT_FIELDS
+};
+
+struct TimerList {
+    TimerData *head, *tail;
+    long long len;
+};
+
+/* many timers under one key, they share the overhead of the key and go away with it */
+typedef struct TimerSet {
+    RedisModuleDict *members;   /* member name -> TimerData */
+    RedisModuleString *key;     /* key holding the set, to remove fired one-time members */
+} TimerSet;
+
+/* strings shared by timers, function names and short args repeated across timers, payload entries
+ * refer to them by pointer instead of holding copies */
+typedef struct InternString {
+    long long refcount;         /* may be decremented by lazyfree thread, unused strings are swept by cron */
+    size_t len;
+    char str[];
+} InternString;
+
+#define INTERN_SEEN_SIZE 4096   /* an arg is interned from the second time it's seen in this many recent hashes */
+#define PACK_STACK 16           /* strings of a timer packed without heap allocation */
+
+static struct {
+    RedisModuleDict *strings;   /* str -> InternString */
+    uint64_t seen[INTERN_SEEN_SIZE];
+    long long hits;             /* strings found interned */
+    long long misses;           /* strings interned, or stored inline as not seen before */
+    long long bytes;            /* memory of the strings */
+    long long unused;           /* strings not referred, may be updated by lazyfree thread */
+    long long refs;             /* references to the strings, may be updated by lazyfree thread */
+    long long refBytes;         /* length of the referred strings, once per reference, ditto */
+} intern;
+
+/* Hierarchical timing wheel, all the timers are driven by a single module timer.
+ * A timer lives in the level of the highest 6-bit digit its deadline differs from
+ * `now`, and is cascaded to a lower level when `now` enters its slot, so insert and
+ * cancel are O(1) and every timer is cascaded at most WHEEL_LEVELS times. */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 11     /* 66 bits, covers the whole mstime_t range */
+
+static struct {
+    mstime_t now;               /* timers expire before or at `now` are in `ready` */
+    uint64_t occupied[WHEEL_LEVELS];   /* bitmap of non empty slots */
+    TimerList slots[WHEEL_LEVELS][WHEEL_SIZE];
+    RedisModuleTimerID tid;     /* the module timer driving the wheel */
+    mstime_t armed;             /* deadline `tid` armed for, 0 if not armed */
+} wheel;
+
+/* expired timers waiting to fire, grouped by db, drained within a time budget per event loop */
+static struct {
+    TimerList *ready;           /* one list per db */
+    int dbnum;
+    int cursor;                 /* db to start with next time, avoid starving the others */
+} dispatcher;
+
+/* streams appended by stream timers firing in the same db, each is opened once and kept open
+ * until the db is done, or any other action runs, which may touch the streams */
+#define STREAM_SINKS 16
+
+typedef struct StreamSink {
+    RedisModuleString *name;
+    RedisModuleKey *key;
+    long long maxlen;           /* trim to the smallest maxlen of the appended entries, 0 if no trimming */
+    bool approx;                /* approximate trimming only if all the entries asked for it */
+} StreamSink;
+
+static struct {
+    StreamSink streams[STREAM_SINKS];
+    int len;
+} sinks;
+
+/* batch timers fired in the same db and tick, grouped by function, each function is called once,
+ * in cluster grouped by the slot of the keys too, one FCALL can't take keys of several slots */
+#define CALL_BATCHES 16
+#define CALL_BATCH_MAX 1024     /* call the function when this many timers are batched */
+
+typedef struct CallBatch {
+    RedisModuleString *function;
+    int slot;                   /* of the keys in cluster, -1 if any */
+    long long count;
+    RedisModuleString **keys;   /* keys of all the timers */
+    size_t numkeys, keyscap;
+    RedisModuleString **args;   /* count, then numkeys, numargs, args of each timer */
+    size_t numargs, argscap;
+} CallBatch;
+
+static struct {
+    CallBatch batches[CALL_BATCHES];
+    int len;
+} batcher;
+
+/* deletions of one-time timers fired in the same db and tick, replicated as one TIMER.MKILL, and one
+ * TIMER.SREM per run of members of the same set, instead of a command per timer.
+ * They are flushed before any script or command runs, which may create the same timers again */
+#define KILL_BATCH_MAX 1024
+
+static struct {
+    bool deferred;              /* set while the wheel fires timers, otherwise deletions are replicated right away */
+    RedisModuleString *keys[KILL_BATCH_MAX];
+    int len;
+    RedisModuleString *set;     /* key of the set the members belong to */
+    RedisModuleString *members[KILL_BATCH_MAX];
+    int nmembers;
+} kills;
+
+/* poll timers fired in a db wait in the queue named by their `function`, until taken by TIMER.POLL */
+typedef struct PollWaiter {
+    RedisModuleBlockedClient *bc;
+    struct PollQueue *queue;
+    long long count;            /* at most `count` timers */
+    struct PollWaiter *prev, *next;
+} PollWaiter;
+
+typedef struct PollQueue {
+    TimerList due;              /* fired timers, in deadline order */
+    PollWaiter *head, *tail;    /* blocked clients, first come first served */
+    int dbid;
+    bool pending;               /* in `poller.pending`, got timers while clients waiting */
+    struct PollQueue *nextPending;
+    size_t len;
+    char name[];
+} PollQueue;
+
+static struct {
+    RedisModuleDict **queues;   /* queue name -> PollQueue, one dict per db */
+    RedisModuleDict *waiters;   /* blocked client -> PollWaiter */
+    PollQueue *pending;         /* queues to serve the waiting clients */
+} poller;
+
+/* statistics of timers in a db */
+typedef struct DbStats {
+    long long timers;
+    long long loops;            /* loop timers, the others are one-time */
+    long long zombies;          /* may be updated by lazyfree thread */
+} DbStats;
+
+#define FIRE_SAMPLES 16         /* fires per second is averaged over this many samples */
+#define FIRE_SAMPLE_PERIOD 100  /* milliseconds between samples */
+
+static struct {
+    DbStats *dbs;               /* one per db */
+    long long payloadBytes;     /* of allocated timers, may be updated by lazyfree thread */
+    long long fired;
+    long long actionErrors;     /* FCALL, CMD or STREAM action failed */
+    mstime_t sampleTime;
+    long long sampleFired;
+    long long samples[FIRE_SAMPLES];
+    int sampleIdx;
+    long long wakeups;          /* wheel callbacks */
+    long long wakeupsSaved;     /* by slack, distinct exact deadlines minus distinct slacked deadlines fired */
+    long long caughtUp;         /* loaded timers whose deadline passed while the server was down */
+    long long skipped;          /* of them, skipped by the `catch-up` policy */
+    long long periodsSkipped;   /* periods of fixed rate loop timers missed and skipped */
+    long long jittered;         /* fires delayed by jitter */
+    long long rateLimited;      /* fires deferred by a rate limit */
+    long long breakerDeferred;  /* fires deferred by a tripped breaker */
+    long long breakerDropped;   /* fires whose action was skipped by a tripped breaker */
+    mstime_t maxDeferral;       /* longest wait of a deferred timer after its deadline, milliseconds */
+} stats;
+
+/* distinct deadlines fired in a wake-up, an open addressing set kept at most half full, it starts in
+ * place and moves to the heap doubling its size for the wake-ups firing more distinct deadlines */
+#define DEADLINE_SET_SIZE 64
+
+typedef struct DeadlineSet {
+    mstime_t local[DEADLINE_SET_SIZE];
+    mstime_t *keys;             /* 0 means empty, no deadline is 0, `local` until grown, NULL before the first add */
+    size_t size;
+    long long distinct;
+} DeadlineSet;
+
+/* Fixed memory histogram with log-linear buckets, like HdrHistogram: values below HIST_SUB are exact,
+ * above that each power of 2 is split into HIST_SUB buckets, so the relative error is at most 1/HIST_SUB */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40    /* values are capped at 2^40-1, about 12 days in microseconds */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct Histogram {
+    long long count;
+    long long max;
+    long long buckets[HIST_BUCKETS];
+} Histogram;
+
+/* in microseconds */
+static Histogram fireLag;           /* from the deadline to the time a timer fired */
+static Histogram actionDuration;    /* time taken by the action of a fired timer */
+static Histogram wakeupFires;       /* timers fired in a wake-up, not in microseconds */
+
+/* state of RDB loading, loaded timers are kept aside and scheduled in one pass when loading ends */
+static struct {
+    bool active;                /* between the start and the end of loading, not set for RESTORE */
+    bool replica;               /* loading the RDB of master in a full sync */
+    mstime_t monotonic;         /* clocks sampled when loading started, to convert the deadlines */
+    mstime_t wallclock;
+    TimerList pending;          /* loaded timers to schedule */
+    TimerList skipped;          /* one-time timers skipped by the `catch-up` policy, deleted when loading ends */
+    bool restored;              /* a RESTORE skipped some, they are deleted once it returns */
+} loading;
+
+/* timers of a passive replica, kept aside instead of the wheel until the node is promoted */
+static struct {
+    bool active;
+    TimerList timers;
+} passive;
+
+/* token bucket limiting how many timers fire per second, timers over the limit wait in its backlog
+ * in deadline order, and fire as the bucket refills */
+typedef struct RateLimit {
+    long long rate;             /* fires per second, 0 means no limit */
+    long long burst;            /* size of the bucket */
+    double tokens;
+    long long refillUs;         /* time the bucket was last refilled */
+    TimerList backlog;
+    long long deferred;         /* timers ever put in the backlog */
+    mstime_t maxDeferral;       /* longest wait of a deferred timer after its deadline, milliseconds */
+} RateLimit;
+
+static struct {
+    RateLimit global;           /* of all the timers, set by `fire-rate` and `fire-burst` */
+    RedisModuleDict *functions; /* function -> RateLimit, set by TIMER.LIMIT */
+} limits;
+
+enum {
+    BREAKER_CLOSED = 0, /* the function runs */
+    BREAKER_OPEN,       /* tripped, fires of the function are deferred or dropped until `until` */
+    BREAKER_HALF_OPEN,  /* cooldown passed, one trial fire is running, it closes or opens the breaker */
+};
+
+static const char *const breakerStates[] = {"closed", "open", "half-open"};
+
+/* circuit breaker of a function, tripped when its executions of a window are too slow or fail too often */
+typedef struct Breaker {
+    int state;
+    mstime_t until;             /* end of the cooldown, or of the trial if half-open */
+    long long calls;            /* executions of the current window */
+    long long slow;             /* of them, slower than `breaker-slow` */
+    long long errors;           /* of them, failed */
+    long long executions;       /* executions ever measured */
+    long long failures;         /* of them, failed */
+    long long maxUs;            /* longest execution, microseconds */
+    long long trips;
+    long long dropped;          /* fires whose action was skipped while tripped */
+    TimerList backlog;          /* fires deferred while tripped */
+} Breaker;
+
+static RedisModuleDict *breakers;  /* function -> Breaker, of the functions executed with a breaker enabled */
+
+/* module configs, set by module arguments or TIMER.CONFIG SET */
+typedef struct ModuleConfig {
+    const char *name;
+    long long *value;
+    long long min;
+    long long max;
+    const char *const *enums;   /* names of the values from 0 to max, NULL if numeric */
+} ModuleConfig;
+
+/* what to do with a timer whose deadline passed while the server was down */
+enum {
+    CATCH_UP_NOW = 0,   /* fire right after loading */
+    CATCH_UP_SPREAD,    /* fire within `catch-up-window` after loading, at a random but stable offset per timer */
+    CATCH_UP_SKIP,      /* skip the missed fires, one-time timers are deleted, loop timers keep their phase */
+};
+
+static const char *const catchUpPolicies[] = {"now", "spread", "skip"};
+
+/* how a replica handles timers */
+enum {
+    REPLICA_PASSIVE = 0,    /* keep timers unscheduled and rely on master's deletions, schedule them on promotion */
+    REPLICA_ACTIVE,         /* run the timers like master, without their actions */
+};
+
+static const char *const replicaModes[] = {"passive", "active"};
+
+/* how timers loaded from RDB are scheduled, per timer is the old path kept to benchmark against */
+enum {
+    LOAD_ONE_PASS = 0,      /* kept aside and scheduled in one pass when loading ends, the wheel armed once */
+    LOAD_PER_TIMER,         /* inserted in the wheel and the wheel armed as each one is loaded */
+};
+
+static const char *const loadSchedulings[] = {"one-pass", "per-timer"};
+
+/* what to do with the fires of a function whose breaker is tripped */
+enum {
+    BREAKER_DEFER = 0,  /* keep them in the backlog of the breaker until it closes */
+    BREAKER_DROP,       /* skip the action, one-time timers are deleted, loop timers keep running */
+};
+
+static const char *const breakerPolicies[] = {"defer", "drop"};
+
+static long long dispatchBudget = 2000; /* microseconds of firing timers per event loop, 0 means no limit */
+static long long internMaxLen = 64;     /* longest arg to intern, 0 means function names only */
+static long long catchUp = CATCH_UP_NOW;
+static long long catchUpWindow = 10000; /* milliseconds */
+static long long replicaMode = REPLICA_PASSIVE;
+static long long defaultJitter = 0;     /* milliseconds, jitter of timers created without JITTER */
+static long long fireRate = 0;          /* fires per second of all the timers, 0 means no limit */
+static long long fireBurst = 0;         /* fires above `fire-rate` allowed at once, 0 means `fire-rate` */
+static long long breakerSlow = 0;       /* microseconds, p99 execution time tripping a breaker, 0 means none */
+static long long breakerErrorRate = 0;  /* percent of failed executions tripping a breaker, 0 means none */
+static long long breakerWindow = 100;   /* executions a breaker is evaluated over */
+static long long breakerCooldown = 10000; /* milliseconds a tripped breaker stays open */
+static long long breakerPolicy = BREAKER_DEFER;
+static long long loadScheduling = LOAD_ONE_PASS;
+
+static ModuleConfig configs[] = {
+    {.name = "dispatch-budget", .value = &dispatchBudget, .min = 0, .max = LLONG_MAX},
+    {.name = "intern-max-len", .value = &internMaxLen, .min = 0, .max = 4096},
+    {.name = "catch-up", .value = &catchUp, .min = 0, .max = CATCH_UP_SKIP, .enums = catchUpPolicies},
+    {.name = "catch-up-window", .value = &catchUpWindow, .min = 0, .max = LLONG_MAX},
+    {.name = "jitter", .value = &defaultJitter, .min = 0, .max = LLONG_MAX},
+    {.name = "fire-rate", .value = &fireRate, .min = 0, .max = LLONG_MAX},
+    {.name = "fire-burst", .value = &fireBurst, .min = 0, .max = LLONG_MAX},
+    {.name = "breaker-slow", .value = &breakerSlow, .min = 0, .max = LLONG_MAX},
+    {.name = "breaker-error-rate", .value = &breakerErrorRate, .min = 0, .max = 100},
+    {.name = "breaker-window", .value = &breakerWindow, .min = 1, .max = LLONG_MAX},
+    {.name = "breaker-cooldown", .value = &breakerCooldown, .min = 0, .max = LLONG_MAX},
+    {.name = "breaker-policy", .value = &breakerPolicy, .min = 0, .max = BREAKER_DROP, .enums = breakerPolicies},
+    {.name = "replica-mode", .value = &replicaMode, .min = 0, .max = REPLICA_ACTIVE, .enums = replicaModes},
+    {.name = "load-scheduling", .value = &loadScheduling, .min = 0, .max = LOAD_PER_TIMER, .enums = loadSchedulings},
+    {.name = NULL}
+};
+
 static RedisModuleType *moduleType;
-static long long timers = 0;
+static RedisModuleType *setType;
+static long long timers = 0;    /* allocated timers, including zombies, may be freed by lazyfree thread */
+static long long zombies = 0;   /* timers deleted from db but not freed yet */
+static TimerData *firing = NULL; /* timer being fired, freeing it is deferred until firing is done */
 static bool isMaster = true;
 
 static const int MODULE_VERSION = 1;
-static const int ENCODE_VERSION = 1;
+static const int ENCODE_VERSION = 3;
+static const int SET_ENCODE_VERSION = 2;   /* members are saved as timers of ENCODE_VERSION SET_ENCODE_VERSION+1 */
+
+/* since ENCODE_VERSION 2 optional fields are saved after the version 1 fields as tag & value pairs,
+ * since ENCODE_VERSION 3 the interval is saved as is, followed by the absolute deadline in unix milliseconds,
+ * before that one-time timers saved the remaining time as interval, loop timers restarted the interval */
+enum {
+    RDB_OPT_ACTION = 1,
+    RDB_OPT_MAXLEN = 2,
+    RDB_OPT_SLACK = 3,
+    RDB_OPT_RATE = 4,
+    RDB_OPT_TIMES = 5,
+    RDB_OPT_JITTER = 6,
+};
+
+void WheelCallback(RedisModuleCtx *ctx, void *data);
+void RestoredCallback(RedisModuleCtx *ctx, void *data);
+static void emitTimer(RedisModuleCtx *ctx, RedisModuleIO *io, RedisModuleString *setkey, const TimerData *td);
+static void unlinkTimer(TimerData *td);
+static int keySlot(const RedisModuleString *key);
+void set_FreeCallBack(void *value);
+
+/* monotonic clock in microseconds, immune to system time changes */
+static long long monotonicUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static mstime_t monotonicMs(void) {
+    return monotonicUs() / 1000;
+}
+
+static void listAppend(TimerList *list, TimerData *td) {
+    td->list = list;
+    td->next = NULL;
+    td->prev = list->tail;
+    if (list->tail) {
+        list->tail->next = td;
+    } else {
+        list->head = td;
+    }
+    list->tail = td;
+    list->len++;
+}
+
+/* insert `td` after `prev`, or at the head if `prev` is NULL */
+static void listInsertAfter(TimerList *list, TimerData *prev, TimerData *td) {
+    td->list = list;
+    td->prev = prev;
+    td->next = prev ? prev->next : list->head;
+    if (td->next) {
+        td->next->prev = td;
+    } else {
+        list->tail = td;
+    }
+    if (prev) {
+        prev->next = td;
+    } else {
+        list->head = td;
+    }
+    list->len++;
+}
+
+static void listRemove(TimerData *td) {
+    TimerList *list = td->list;
+    if (td->prev) {
+        td->prev->next = td->next;
+    } else {
+        list->head = td->next;
+    }
+    if (td->next) {
+        td->next->prev = td->prev;
+    } else {
+        list->tail = td->prev;
+    }
+    list->len--;
+    td->prev = td->next = NULL;
+    td->list = NULL;
+}
+
+/* move all the timers of `src` to the end of `dst` */
+static void listConcat(TimerList *dst, TimerList *src) {
+    if (!src->head) return;
+    for (TimerData *td = src->head; td; td = td->next) {
+        td->list = dst;
+    }
+    if (dst->tail) {
+        dst->tail->next = src->head;
+        src->head->prev = dst->tail;
+    } else {
+        dst->head = src->head;
+    }
+    dst->tail = src->tail;
+    dst->len += src->len;
+    src->head = src->tail = NULL;
+    src->len = 0;
+}
+
+/* FNV-1a */
+static uint64_t internHash(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static void internRetain(InternString *is) {
+    if (__atomic_fetch_add(&is->refcount, 1, __ATOMIC_RELAXED) == 0) {
+        __atomic_fetch_sub(&intern.unused, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&intern.refs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&intern.refBytes, is->len, __ATOMIC_RELAXED);
+}
+
+/* may be called in lazyfree thread, so an unused string is left for internSweep */
+static void internRelease(InternString *is) {
+    __atomic_fetch_sub(&intern.refs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&intern.refBytes, is->len, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&is->refcount, 1, __ATOMIC_RELAXED) == 0) {
+        __atomic_fetch_add(&intern.unused, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Take a reference of the interned `s`, NULL if not interned. Unless `always`, a string is interned
+ * only if seen recently, interning a string used once costs more than a copy */
+static InternString *internGet(const char *s, size_t len, bool always) {
+    InternString *is = RedisModule_DictGetC(intern.strings, (void *)s, len, NULL);
+    if (is) {
+        intern.hits++;
+    } else {
+        intern.misses++;
+        if (!always) {
+            uint64_t h = internHash(s, len);
+            uint64_t *seen = &intern.seen[h % INTERN_SEEN_SIZE];
+            if (*seen != h) {
+                *seen = h;
+                return NULL;
+            }
+        }
+        is = RedisModule_Alloc(sizeof(*is) + len);
+        is->refcount = 0;
+        is->len = len;
+        memcpy(is->str, s, len);
+        RedisModule_DictSetC(intern.strings, (void *)s, len, is);
+        intern.bytes += sizeof(*is) + len;
+        __atomic_fetch_add(&intern.unused, 1, __ATOMIC_RELAXED);
+    }
+    internRetain(is);
+    return is;
+}
+
+/* free the unused strings once they are the majority, only the main thread takes references,
+ * so an unused string stays unused */
+static void internSweep(void) {
+    long long unused = __atomic_load_n(&intern.unused, __ATOMIC_RELAXED);
+    if (unused == 0 || (uint64_t)unused * 2 < RedisModule_DictSize(intern.strings)) return;
+    InternString **sweep = RedisModule_Alloc(sizeof(InternString*) * unused);
+    int n = 0;
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(intern.strings, "^", NULL, 0);
+    InternString *is;
+    while (n < unused && RedisModule_DictNextC(iter, NULL, (void **)&is)) {
+        if (__atomic_load_n(&is->refcount, __ATOMIC_RELAXED) == 0) {
+            sweep[n++] = is;
+        }
+    }
+    RedisModule_DictIteratorStop(iter);
+    for (int i = 0; i < n; i++) {
+        RedisModule_DictDelC(intern.strings, sweep[i]->str, sweep[i]->len, NULL);
+        intern.bytes -= sizeof(*sweep[i]) + sweep[i]->len;
+        RedisModule_Free(sweep[i]);
+    }
+    __atomic_fetch_sub(&intern.unused, n, __ATOMIC_RELAXED);
+    RedisModule_Free(sweep);
+}
+
+/* A payload entry starts with varint `len << 1`, followed by the string, or if the low bit is set,
+ * by a pointer to the InternString */
+static size_t varintLen(size_t v) {
+    size_t n = 1;
+    for (; v >= 0x80; v >>= 7) {
+        n++;
+    }
+    return n;
+}
+
+static char *varintAppend(char *p, size_t v) {
+    while (v >= 0x80) {
+        *p++ = (char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char)v;
+    return p;
+}
+
+/* bytes of an entry holding a string of `len` */
+static size_t payloadLen(size_t len) {
+    return varintLen(len << 1) + len;
+}
+
+/* bytes of an entry referring to an interned string */
+static size_t payloadInternLen(const InternString *is) {
+    return varintLen(is->len << 1 | 1) + sizeof(is);
+}
+
+/* append a string to the payload, return the end */
+static char *payloadAppend(char *p, const char *s, size_t len) {
+    p = varintAppend(p, len << 1);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/* append a reference of an interned string to the payload, return the end */
+static char *payloadAppendIntern(char *p, InternString *is) {
+    p = varintAppend(p, is->len << 1 | 1);
+    memcpy(p, &is, sizeof(is));
+    return p + sizeof(is);
+}
+
+/* decode the entry at `p`, `*is` is set to the interned string it refers to or NULL, return the next entry */
+static const char *payloadEntry(const char *p, const char **s, size_t *len, InternString **is) {
+    size_t v = 0;
+    int shift = 0;
+    unsigned char c;
+    do {
+        c = (unsigned char)*p++;
+        v |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    if (v & 1) {
+        memcpy(is, p, sizeof(*is));
+        *s = (*is)->str;
+        *len = (*is)->len;
+        return p + sizeof(*is);
+    }
+    *is = NULL;
+    *s = p;
+    *len = v >> 1;
+    return p + *len;
+}
+
+/* decode the string at `p`, return the next entry */
+static const char *payloadNext(const char *p, const char **s, size_t *len) {
+    InternString *is;
+    return payloadEntry(p, s, len, &is);
+}
+
+/* the `index`th string of the payload */
+static const char *payloadAt(const TimerData *td, int index, size_t *len) {
+    const char *p = td->payload, *s;
+    for (int i = 0; i <= index; i++) {
+        p = payloadNext(p, &s, len);
+    }
+    return s;
+}
+
+static RedisModuleString *payloadString(RedisModuleCtx *ctx, const TimerData *td, int index) {
+    size_t len;
+    const char *s = payloadAt(td, index, &len);
+    return RedisModule_CreateString(ctx, s, len);
+}
+
+/* build strings of function keys & args into `data`, which has room for `td->datalen` */
+static void payloadData(RedisModuleCtx *ctx, const TimerData *td, RedisModuleString **data) {
+    const char *p = td->payload, *s;
+    size_t len;
+    p = payloadNext(p, &s, &len);   /* key */
+    p = payloadNext(p, &s, &len);   /* function */
+    for (int i = 0; i < td->datalen; i++) {
+        p = payloadNext(p, &s, &len);
+        data[i] = RedisModule_CreateString(ctx, s, len);
+    }
+}
+
+/* bytes taken by the optional fields in `ext` */
+static inline size_t extSize(uint8_t ext) {
+    return sizeof(int64_t) * __builtin_popcount(ext);
+}
+
+/* address of optional `field`, which must be present, fields are not aligned */
+static inline char *extAt(const TimerData *td, int field) {
+    const char *end = td->payload + td->size;
+    return (char *)end - extSize(td->ext) + extSize(td->ext & ((1U << field) - 1));
+}
+
+static int64_t extGet(const TimerData *td, int field) {
+    int64_t v;
+    memcpy(&v, extAt(td, field), sizeof(v));
+    return v;
+}
+
+static void extSet(TimerData *td, int field, int64_t v) {
+    memcpy(extAt(td, field), &v, sizeof(v));
+}
+
+/* the set `td` is a member of, NULL if it's the value of its own key */
+static inline TimerSet *timerOwner(const TimerData *td) {
+    return td->ext & (1U << EXT_OWNER) ? (TimerSet *)(intptr_t)extGet(td, EXT_OWNER) : NULL;
+}
+
+/* `v >> shift` without undefined behavior when shift >= 64 */
+static inline uint64_t shiftRight(uint64_t v, int shift) {
+    return shift < 64 ? v >> shift : 0;
+}
+
+static inline bool isWheelSlot(TimerList *list) {
+    return list >= &wheel.slots[0][0] && list < &wheel.slots[0][0] + WHEEL_LEVELS * WHEEL_SIZE;
+}
+
+/* the deadline in [expire, expire+slack] with the most trailing zero bits, so timers with close
+ * deadlines are rounded to the same one and fired in one wake-up, like the timer slack of linux */
+static mstime_t slackDeadline(mstime_t expire, mstime_t slack) {
+    uint64_t end = (uint64_t)(expire + slack);
+    uint64_t diff = end ^ (uint64_t)expire;
+    if (!diff) return expire;
+    int bit = 63 - __builtin_clzll(diff);
+    return (mstime_t)(end >> bit << bit);
+}
+
+static uint64_t keyHash(const TimerData *td) {
+    size_t len;
+    const char *key = payloadAt(td, PAYLOAD_KEY, &len);
+    return internHash(key, len);
+}
+
+/* delay of the deadlines of `td` by jitter, random in [0, jitter] but fixed by the key, so it's the same
+ * for every run of a loop timer, on replicas and after restarts */
+static mstime_t jitterOffset(const TimerData *td) {
+    long long jitter = td->ext & (1U << EXT_JITTER) ? extGet(td, EXT_JITTER) : defaultJitter;
+    if (jitter <= 0) return 0;
+    uint64_t hash = td->ext & (1U << EXT_HASH) ? (uint64_t)extGet(td, EXT_HASH) : keyHash(td);
+    return (mstime_t)(hash % ((uint64_t)jitter + 1));
+}
+
+/* deadline the timer is scheduled at, `expire` is kept exact */
+static inline mstime_t timerDeadline(const TimerData *td) {
+    mstime_t deadline = td->expire + jitterOffset(td);
+    if (!(td->ext & (1U << EXT_SLACK))) return deadline;
+    return slackDeadline(deadline, extGet(td, EXT_SLACK));
+}
+
+/* schedule `td` at its deadline, expired timer goes to the ready list of its db,
+ * on a passive replica it's only kept aside */
+static void wheelInsert(TimerData *td) {
+    if (passive.active) {
+        listAppend(&passive.timers, td);
+        return;
+    }
+    mstime_t deadline = timerDeadline(td);
+    if (deadline <= wheel.now) {
+        listAppend(&dispatcher.ready[td->dbid], td);
+        return;
+    }
+    uint64_t diff = (uint64_t)deadline ^ (uint64_t)wheel.now;
+    int level = (63 - __builtin_clzll(diff)) / WHEEL_BITS;
+    int slot = (int)(shiftRight(deadline, level * WHEEL_BITS) & WHEEL_MASK);
+    listAppend(&wheel.slots[level][slot], td);
+    wheel.occupied[level] |= 1ULL << slot;
+}
+
+/* unschedule `td`, no-op if not scheduled */
+static void wheelRemove(TimerData *td) {
+    TimerList *list = td->list;
+    if (!list) return;
+    listRemove(td);
+    if (isWheelSlot(list) && !list->head) {
+        long index = list - &wheel.slots[0][0];
+        wheel.occupied[index / WHEEL_SIZE] &= ~(1ULL << (index % WHEEL_SIZE));
+    }
+}
+
+/* move `now` forward to `to`, cascade the slots `now` passed by, expired timers end up in `ready` */
+static void wheelAdvance(mstime_t to) {
+    if (to <= wheel.now) return;
+    TimerList pending = {NULL, NULL, 0};
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = level * WHEEL_BITS;
+        uint64_t mask;
+        if (shiftRight(to, shift + WHEEL_BITS) != shiftRight(wheel.now, shift + WHEEL_BITS)) {
+            mask = ~0ULL; /* upper level moved, every slot of this level is passed */
+        } else {
+            int from = (int)(shiftRight(wheel.now, shift) & WHEEL_MASK);
+            int upto = (int)(shiftRight(to, shift) & WHEEL_MASK);
+            if (from == upto) break; /* neither this level nor upper levels moved */
+            mask = ((2ULL << upto) - 1) & ~((2ULL << from) - 1); /* slots (from, upto] */
+        }
+        uint64_t hit = wheel.occupied[level] & mask;
+        while (hit) {
+            int slot = __builtin_ctzll(hit);
+            hit &= hit - 1;
+            listConcat(&pending, &wheel.slots[level][slot]);
+        }
+        wheel.occupied[level] &= ~mask;
+    }
+    wheel.now = to;
+    while (pending.head) {
+        TimerData *td = pending.head;
+        listRemove(td);
+        wheelInsert(td);
+    }
+}
+
+static void refillLimit(RateLimit *limit, long long now) {
+    if (limit->rate <= 0) return;
+    double tokens = limit->tokens + (double)(now - limit->refillUs) * limit->rate / 1000000;
+    limit->tokens = tokens < limit->burst ? tokens : limit->burst;
+    limit->refillUs = now;
+}
+
+/* refill every bucket, the global one picks up changes of its configs */
+static void refillLimits(long long now) {
+    limits.global.rate = fireRate;
+    limits.global.burst = fireBurst ? fireBurst : fireRate;
+    refillLimit(&limits.global, now);
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(limits.functions, "^", NULL, 0);
+    RateLimit *limit;
+    while (RedisModule_DictNextC(iter, NULL, (void **)&limit)) {
+        refillLimit(limit, now);
+    }
+    RedisModule_DictIteratorStop(iter);
+}
+
+static inline bool hasToken(const RateLimit *limit) {
+    return limit->rate <= 0 || limit->tokens >= 1;
+}
+
+/* microseconds until the bucket has a token */
+static long long tokenWait(const RateLimit *limit) {
+    if (hasToken(limit)) return 0;
+    return (long long)((1 - limit->tokens) * 1000000 / limit->rate) + 1;
+}
+
+/* limit of the function of `td`, the command for CMD, the queue for POLL, NULL if none */
+static RateLimit *functionLimit(const TimerData *td) {
+    if (!RedisModule_DictSize(limits.functions)) return NULL;
+    size_t len;
+    const char *function = payloadAt(td, PAYLOAD_FUNCTION, &len);
+    return RedisModule_DictGetC(limits.functions, (void *)function, len, NULL);
+}
+
+/* put `td` in `backlog` by deadline, usually at the tail */
+static void deferTimer(TimerList *backlog, TimerData *td) {
+    mstime_t deadline = timerDeadline(td);
+    TimerData *prev = backlog->tail;
+    while (prev && timerDeadline(prev) > deadline) {
+        prev = prev->prev;
+    }
+    listInsertAfter(backlog, prev, td);
+}
+
+/* return false if the global bucket or the function bucket of the expired `td` is empty, `td` is then
+ * deferred in the backlog of the empty one. The tokens are taken by TimerCallback if `td` runs */
+static bool limitTimer(TimerData *td) {
+    RateLimit *function = functionLimit(td);
+    RateLimit *empty = !hasToken(&limits.global) ? &limits.global : function && !hasToken(function) ? function : NULL;
+    if (empty) {
+        deferTimer(&empty->backlog, td);
+        empty->deferred++;
+        stats.rateLimited++;
+        return false;
+    }
+    return true;
+}
+
+/* take a token from the global bucket and the function bucket of `td`, which runs */
+static void takeTokens(const TimerData *td) {
+    RateLimit *function = functionLimit(td);
+    if (limits.global.rate > 0) limits.global.tokens--;
+    if (function && function->rate > 0) function->tokens--;
+}
+
+/* the deferred timer with the earliest deadline that has the tokens to fire, NULL if none, `from` is
+ * set to the limit it's deferred by. A timer of the global backlog whose function bucket is empty moves
+ * to the backlog of its function */
+static TimerData *nextDeferred(RateLimit **from) {
+    if (!hasToken(&limits.global)) return NULL;
+    TimerData *next = NULL;
+    RateLimit *function;
+    while (limits.global.backlog.head) {
+        TimerData *td = limits.global.backlog.head;
+        function = functionLimit(td);
+        if (!function || hasToken(function)) {
+            next = td;
+            *from = &limits.global;
+            break;
+        }
+        listRemove(td);
+        deferTimer(&function->backlog, td);
+    }
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(limits.functions, "^", NULL, 0);
+    while (RedisModule_DictNextC(iter, NULL, (void **)&function)) {
+        TimerData *td = function->backlog.head;
+        if (td && hasToken(function) && (!next || timerDeadline(td) < timerDeadline(next))) {
+            next = td;
+            *from = function;
+        }
+    }
+    RedisModule_DictIteratorStop(iter);
+    return next;
+}
+
+/* earliest time a deferred timer may fire, -1 if no timer is deferred */
+static mstime_t limitsNext(void) {
+    if (!limits.global.backlog.head && !RedisModule_DictSize(limits.functions)) return -1;
+    long long now = monotonicUs();
+    refillLimits(now);
+    long long wait = limits.global.backlog.head ? tokenWait(&limits.global) : -1;
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(limits.functions, "^", NULL, 0);
+    RateLimit *function;
+    while (RedisModule_DictNextC(iter, NULL, (void **)&function)) {
+        if (!function->backlog.head) continue;
+        long long w = tokenWait(function);
+        if (w < tokenWait(&limits.global)) w = tokenWait(&limits.global);
+        if (wait < 0 || w < wait) wait = w;
+    }
+    RedisModule_DictIteratorStop(iter);
+    return wait < 0 ? -1 : (now + wait + 999) / 1000;
+}
+
+/* take `td` out of the backlog of `limit` to fire, record how long it waited */
+static void releaseDeferred(RateLimit *limit, TimerData *td, mstime_t now) {
+    mstime_t waited = now - timerDeadline(td);
+    if (waited > limit->maxDeferral) limit->maxDeferral = waited;
+    if (waited > stats.maxDeferral) stats.maxDeferral = waited;
+    listRemove(td);
+}
+
+/* number of timers deferred by the rate limits, and the longest wait after the deadline of them,
+ * fired or still waiting */
+static long long deferredBacklog(mstime_t *maxDeferral) {
+    mstime_t now = monotonicMs();
+    long long backlog = limits.global.backlog.len;
+    *maxDeferral = stats.maxDeferral;
+    if (limits.global.backlog.head && now - timerDeadline(limits.global.backlog.head) > *maxDeferral) {
+        *maxDeferral = now - timerDeadline(limits.global.backlog.head);
+    }
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(limits.functions, "^", NULL, 0);
+    RateLimit *function;
+    while (RedisModule_DictNextC(iter, NULL, (void **)&function)) {
+        backlog += function->backlog.len;
+        if (function->backlog.head && now - timerDeadline(function->backlog.head) > *maxDeferral) {
+            *maxDeferral = now - timerDeadline(function->backlog.head);
+        }
+    }
+    RedisModule_DictIteratorStop(iter);
+    return backlog;
+}
+
+/* the breaker of the function of `td` if it's tripped and doesn't let `td` fire, NULL if `td` may fire.
+ * Once the cooldown passed, a fire is let through as the trial */
+static Breaker *trippedBreaker(const TimerData *td) {
+    if (td->action == ACTION_POLL || td->action == ACTION_STREAM || !RedisModule_DictSize(breakers)) return NULL;
+    size_t len;
+    const char *function = payloadAt(td, PAYLOAD_FUNCTION, &len);
+    Breaker *breaker = RedisModule_DictGetC(breakers, (void *)function, len, NULL);
+    if (!breaker || breaker->state == BREAKER_CLOSED) return NULL;
+    mstime_t now = monotonicMs();
+    if (now < breaker->until) return breaker;
+    breaker->state = BREAKER_HALF_OPEN;
+    breaker->until = now + breakerCooldown; /* a trial that never reports back is retried after a cooldown */
+    return NULL;
+}
+
+/* close the breaker, the fires it deferred are expired, they go back to the ready lists */
+static void closeBreaker(Breaker *breaker) {
+    breaker->state = BREAKER_CLOSED;
+    breaker->calls = breaker->slow = breaker->errors = 0;
+    while (breaker->backlog.head) {
+        TimerData *td = breaker->backlog.head;
+        listRemove(td);
+        wheelInsert(td);
+    }
+}
+
+/* measure an execution of `function` for `count` timers, trip its breaker if the window is over the thresholds,
+ * the trial execution of a half-open breaker closes or opens it */
+static void recordExecution(RedisModuleCtx *ctx, RedisModuleString *function, long long count, long long duration, bool failed) {
+    size_t len;
+    const char *name = RedisModule_StringPtrLen(function, &len);
+    Breaker *breaker = RedisModule_DictGetC(breakers, (void *)name, len, NULL);
+    if (!breaker) {
+        if (!breakerSlow && !breakerErrorRate) return;
+        breaker = RedisModule_Calloc(1, sizeof(*breaker));
+        RedisModule_DictSetC(breakers, (void *)name, len, breaker);
+    }
+    bool slow = breakerSlow && duration > breakerSlow * count; /* a batch may take as long as its fires one by one */
+    failed = failed && breakerErrorRate;
+    breaker->executions++;
+    breaker->failures += failed;
+    if (duration > breaker->maxUs) breaker->maxUs = duration;
+    mstime_t now = monotonicMs();
+    if (breaker->state != BREAKER_CLOSED) {
+        if (slow || failed) {
+            RedisModule_Log(ctx, "warning", "breaker of %.*s tripped, trial execution %s", (int)len, name, failed ? "failed" : "slow");
+            breaker->state = BREAKER_OPEN;
+            breaker->until = now + breakerCooldown;
+            breaker->trips++;
+        } else {
+            closeBreaker(breaker);
+            RedisModule_Log(ctx, "notice", "breaker of %.*s closed", (int)len, name);
+        }
+        return;
+    }
+    breaker->calls++;
+    breaker->slow += slow;
+    breaker->errors += failed;
+    if (breaker->calls < breakerWindow) return;
+    /* the p99 is above the threshold if more than 1% of the executions are */
+    bool trip = breaker->slow * 100 > breaker->calls || (breakerErrorRate && breaker->errors * 100 >= breakerErrorRate * breaker->calls);
+    if (trip) {
+        RedisModule_Log(ctx, "warning", "breaker of %.*s tripped, %lld slow and %lld failed of %lld executions, %s its fires for %lld ms",
+                        (int)len, name, breaker->slow, breaker->errors, breaker->calls,
+                        breakerPolicy == BREAKER_DROP ? "dropping" : "deferring", breakerCooldown);
+        breaker->state = BREAKER_OPEN;
+        breaker->until = now + breakerCooldown;
+        breaker->trips++;
+    }
+    breaker->calls = breaker->slow = breaker->errors = 0;
+}
+
+/* let the first deferred fire of every breaker whose cooldown passed go as its trial */
+static void releaseBreakerTrials(mstime_t now) {
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(breakers, "^", NULL, 0);
+    Breaker *breaker;
+    while (RedisModule_DictNextC(iter, NULL, (void **)&breaker)) {
+        TimerData *td = breaker->backlog.head;
+        if (td && now >= breaker->until) {
+            listRemove(td);
+            wheelInsert(td);
+        }
+    }
+    RedisModule_DictIteratorStop(iter);
+}
+
+/* earliest end of a cooldown with fires waiting for it, -1 if none */
+static mstime_t breakersNext(void) {
+    mstime_t next = -1;
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(breakers, "^", NULL, 0);
+    Breaker *breaker;
+    while (RedisModule_DictNextC(iter, NULL, (void **)&breaker)) {
+        if (breaker->backlog.head && (next < 0 || breaker->until < next)) {
+            next = breaker->until;
+        }
+    }
+    RedisModule_DictIteratorStop(iter);
+    return next;
+}
+
+/* number of expired timers waiting to fire */
+static long long dispatchBacklog(void) {
+    long long backlog = 0;
+    for (int i = 0; i < dispatcher.dbnum; i++) {
+        backlog += dispatcher.ready[i].len;
+    }
+    return backlog;
+}
+
+/* earliest time the wheel needs to advance, exact for the lowest level, -1 if no timers */
+static mstime_t wheelNext(void) {
+    if (dispatchBacklog() > 0) return wheel.now;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        if (!wheel.occupied[level]) continue;
+        int shift = level * WHEEL_BITS;
+        uint64_t slot = __builtin_ctzll(wheel.occupied[level]);
+        uint64_t upper = shift + WHEEL_BITS < 64 ? (uint64_t)wheel.now >> (shift + WHEEL_BITS) << (shift + WHEEL_BITS) : 0;
+        return (mstime_t)(upper | (slot << shift));
+    }
+    return -1;
+}
+
+/* make sure the driving module timer fires no later than the next deadline */
+static void wheelArm(RedisModuleCtx *ctx) {
+    mstime_t next = wheelNext(), deferred = limitsNext(), trial = breakersNext();
+    if (deferred >= 0 && (next < 0 || deferred < next)) next = deferred;
+    if (trial >= 0 && (next < 0 || trial < next)) next = trial;
+    if (next < 0 || (wheel.armed && wheel.armed <= next)) return;
+    if (wheel.armed) {
+        RedisModule_StopTimer(ctx, wheel.tid, NULL);
+    }
+    mstime_t period = next - monotonicMs();
+    wheel.tid = RedisModule_CreateTimer(ctx, period > 0 ? period : 0, WheelCallback, NULL);
+    wheel.armed = next;
+}
 
 
+/* Switch between the wheel and the passive list by the role and `replica-mode`.
+ * A passive replica takes every timer out of the wheel, deadlines are kept but loop timers are not
+ * rescheduled, as master does it without replicating. On promotion loop timers move to their next
+ * period after now, keeping the phase, overdue one-time timers fire right away */
+static void applyReplicaMode(RedisModuleCtx *ctx) {
+    bool park = !isMaster && replicaMode == REPLICA_PASSIVE;
+    if (park == passive.active) return;
+    if (park) {
+        for (int level = 0; level < WHEEL_LEVELS; level++) {
+            for (int slot = 0; slot < WHEEL_SIZE; slot++) {
+                listConcat(&passive.timers, &wheel.slots[level][slot]);
+            }
+            wheel.occupied[level] = 0;
+        }
+        for (int i = 0; i < dispatcher.dbnum; i++) {
+            listConcat(&passive.timers, &dispatcher.ready[i]);
+        }
+        listConcat(&passive.timers, &limits.global.backlog);
+        RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(limits.functions, "^", NULL, 0);
+        RateLimit *limit;
+        while (RedisModule_DictNextC(iter, NULL, (void **)&limit)) {
+            listConcat(&passive.timers, &limit->backlog);
+        }
+        RedisModule_DictIteratorStop(iter);
+        iter = RedisModule_DictIteratorStartC(breakers, "^", NULL, 0);
+        Breaker *breaker;
+        while (RedisModule_DictNextC(iter, NULL, (void **)&breaker)) {
+            listConcat(&passive.timers, &breaker->backlog);
+        }
+        RedisModule_DictIteratorStop(iter);
+        if (wheel.armed) {
+            RedisModule_StopTimer(ctx, wheel.tid, NULL);
+            wheel.armed = 0;
+        }
+        passive.active = true;
+        RedisModule_Log(ctx, "notice", "%lld timers kept passive", passive.timers.len);
+        return;
+    }
+    passive.active = false;
+    long long n = passive.timers.len;
+    mstime_t now = monotonicMs();
+    wheelAdvance(now);
+    while (passive.timers.head) {
+        TimerData *td = passive.timers.head;
+        listRemove(td);
+        if (td->loop && td->interval > 0 && td->expire < now) {
+            td->expire += (now - td->expire + td->interval - 1) / td->interval * td->interval;
+        }
+        wheelInsert(td);
+    }
+    wheelArm(ctx);
+    RedisModule_Log(ctx, "notice", "scheduled %lld passive timers", n);
+}
+
 void roleChangeCallback(RedisModuleCtx *ctx, RedisModuleEvent e, uint64_t sub, void *data)
 {
     RedisModule_AutoMemory(ctx);
@@ -35,307 +1143,2749 @@ void roleChangeCallback(RedisModuleCtx *ctx, RedisModuleEvent e, uint64_t sub, v
     REDISMODULE_NOT_USED(data);
     isMaster = (sub == REDISMODULE_EVENT_REPLROLECHANGED_NOW_MASTER);
     RedisModule_Log(ctx, "notice", "role change: %s", isMaster ? "master": "slave");
+    applyReplicaMode(ctx);
+}
+
+static int histIndex(long long v) {
+    if (v < HIST_SUB) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+/* the highest value falling into the bucket */
+static long long histValue(int index) {
+    if (index < HIST_SUB) return index;
+    int shift = index / HIST_SUB - 1;
+    return (((long long)(HIST_SUB + index % HIST_SUB) + 1) << shift) - 1;
+}
+
+static void histRecord(Histogram *h, long long v) {
+    if (v < 0) v = 0;
+    if (v >= 1LL << HIST_MAX_BITS) v = (1LL << HIST_MAX_BITS) - 1;
+    h->buckets[histIndex(v)]++;
+    h->count++;
+    if (v > h->max) h->max = v;
+}
+
+/* value at `percentile`, accurate to the bucket, never above the max */
+static long long histPercentile(const Histogram *h, double percentile) {
+    long long rank = (long long)(percentile / 100 * h->count + 0.5), seen = 0;
+    if (rank < 1) rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            long long v = histValue(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* insert `v` in a table of `size` slots, a power of 2, return false if already in it */
+static bool deadlineSetInsert(mstime_t *keys, size_t size, mstime_t v) {
+    size_t h = (size_t)(((uint64_t)v * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+    while (keys[h]) {
+        if (keys[h] == v) return false;
+        h = (h + 1) & (size - 1);
+    }
+    keys[h] = v;
+    return true;
+}
+
+/* add `v` to the set, return true if it's not in the set */
+static bool deadlineSetAdd(DeadlineSet *set, mstime_t v) {
+    if (!set->keys) {
+        set->keys = set->local;
+        set->size = DEADLINE_SET_SIZE;
+    }
+    if (!deadlineSetInsert(set->keys, set->size, v)) return false;
+    if (++set->distinct * 2 > (long long)set->size) {
+        mstime_t *keys = RedisModule_Calloc(set->size * 2, sizeof(*keys));
+        for (size_t i = 0; i < set->size; i++) {
+            if (set->keys[i]) deadlineSetInsert(keys, set->size * 2, set->keys[i]);
+        }
+        if (set->keys != set->local) RedisModule_Free(set->keys);
+        set->keys = keys;
+        set->size *= 2;
+    }
+    return true;
+}
+
+static void deadlineSetFree(DeadlineSet *set) {
+    if (set->keys && set->keys != set->local) RedisModule_Free(set->keys);
+}
+
+/* allocate a timer with room for `size` bytes of payload, fields other than payload are zeroed */
+TimerData *CreateTimerData(size_t size) {
+    TimerData *td = RedisModule_Alloc(sizeof(*td) + size);
+    memset(td, 0, sizeof(*td));
+    td->size = size;
+    __atomic_fetch_add(&timers, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.payloadBytes, size, __ATOMIC_RELAXED);
+    return td;
+}
+
+/* take or release the references of the interned strings in the payload */
+static void payloadRefs(const TimerData *td, bool retain) {
+    const char *p = td->payload, *s;
+    size_t len;
+    InternString *is;
+    for (int i = 0; i < td->datalen + PAYLOAD_DATA; i++) {
+        p = payloadEntry(p, &s, &len, &is);
+        if (is) {
+            retain ? internRetain(is) : internRelease(is);
+        }
+    }
+}
+
+/* Allocate a timer with `n` strings packed, the key, function, then data, with room for `extsize`
+ * bytes of optional fields. The function is interned, so are the short args repeated across timers */
+static TimerData *packTimerData(const char **strs, const size_t *lens, int n, size_t extsize) {
+    InternString *stack[PACK_STACK], **is = n <= PACK_STACK ? stack : RedisModule_Alloc(sizeof(*is) * n);
+    size_t size = extsize;
+    for (int i = 0; i < n; i++) {
+        is[i] = NULL;
+        if (lens[i] > sizeof(InternString*) && (i == PAYLOAD_FUNCTION || (i >= PAYLOAD_DATA && lens[i] <= (size_t)internMaxLen))) {
+            is[i] = internGet(strs[i], lens[i], i == PAYLOAD_FUNCTION);
+        }
+        size += is[i] ? payloadInternLen(is[i]) : payloadLen(lens[i]);
+    }
+    TimerData *td = CreateTimerData(size);
+    char *p = td->payload;
+    for (int i = 0; i < n; i++) {
+        p = is[i] ? payloadAppendIntern(p, is[i]) : payloadAppend(p, strs[i], lens[i]);
+    }
+    if (is != stack) {
+        RedisModule_Free(is);
+    }
+    return td;
+}
+
+/* release all the memory used in timer structure, may be called in lazyfree thread */
+void DeleteTimerData(TimerData *td) {
+    payloadRefs(td, false);
+    if (td->deleted) {
+        __atomic_fetch_sub(&zombies, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&stats.dbs[td->dbid].zombies, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_sub(&stats.payloadBytes, td->size, __ATOMIC_RELAXED);
+    RedisModule_Free(td);
+    __atomic_fetch_sub(&timers, 1, __ATOMIC_RELAXED);
+}
+
+/* count a timer in or out of the stats of its db */
+static void countTimer(const TimerData *td, int delta) {
+    DbStats *dbs = &stats.dbs[td->dbid];
+    dbs->timers += delta;
+    if (td->loop) dbs->loops += delta;
+}
+
+/* unschedule a timer whose key is gone, it becomes a zombie until freed */
+static void DetachTimerData(TimerData *td) {
+    wheelRemove(td);
+    if (!td->deleted) {
+        countTimer(td, -1);
+        td->deleted = true;
+        __atomic_fetch_add(&zombies, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.dbs[td->dbid].zombies, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* free a detached timer, unless it's firing, then TimerCallback frees it when done */
+static void ReleaseTimerData(TimerData *td) {
+    if (td != firing) {
+        DeleteTimerData(td);
+    }
+}
+
+static TimerSet *createTimerSet(const RedisModuleString *key) {
+    TimerSet *set = RedisModule_Alloc(sizeof(*set));
+    set->members = RedisModule_CreateDict(NULL);
+    set->key = RedisModule_CreateStringFromString(NULL, key);
+    return set;
+}
+
+/* Remove `member` from the set and release its timer, the set key of the selected db is
+ * deleted once empty, which frees `set`. Return false if not a member */
+static bool removeSetMember(RedisModuleCtx *ctx, TimerSet *set, const char *member, size_t len) {
+    TimerData *td;
+    if (RedisModule_DictDelC(set->members, (void *)member, len, &td) != REDISMODULE_OK) {
+        return false;
+    }
+    unlinkTimer(td);
+    ReleaseTimerData(td);
+    if (RedisModule_DictSize(set->members) == 0) {
+        RedisModuleKey *mk = RedisModule_OpenKey(ctx, set->key, REDISMODULE_WRITE);
+        RedisModule_DeleteKey(mk); /* set is freed by free callback */
+        RedisModule_CloseKey(mk);
+    }
+    return true;
+}
+
+/* replicate the deferred deletions in the selected db */
+static void flushKills(RedisModuleCtx *ctx) {
+    if (kills.len) {
+        RedisModule_Replicate(ctx, "timer.mkill", "v", kills.keys, (size_t)kills.len);
+        for (int i = 0; i < kills.len; i++) {
+            RedisModule_FreeString(ctx, kills.keys[i]);
+        }
+        kills.len = 0;
+    }
+    if (kills.nmembers) {
+        RedisModule_Replicate(ctx, "timer.srem", "sv", kills.set, kills.members, (size_t)kills.nmembers);
+        for (int i = 0; i < kills.nmembers; i++) {
+            RedisModule_FreeString(ctx, kills.members[i]);
+        }
+        RedisModule_FreeString(ctx, kills.set);
+        kills.nmembers = 0;
+    }
+}
+
+/* replicate the deletion of a fired timer, deferred if the wheel is firing */
+static void replicateKill(RedisModuleCtx *ctx, TimerSet *set, RedisModuleString *key) {
+    if (!kills.deferred) {
+        if (set) {
+            RedisModule_Replicate(ctx, "timer.srem", "ss", set->key, key);
+        } else {
+            RedisModule_Replicate(ctx, "timer.kill", "s", key);
+        }
+        return;
+    }
+    if (set) {
+        if (kills.nmembers == KILL_BATCH_MAX ||
+            (kills.nmembers && RedisModule_StringCompare(kills.set, set->key) != 0)) {
+            flushKills(ctx);
+        }
+        if (!kills.nmembers) {
+            RedisModule_RetainString(ctx, set->key); /* the set may go away with its last member */
+            kills.set = set->key;
+        }
+        RedisModule_RetainString(ctx, key);
+        kills.members[kills.nmembers++] = key;
+    } else {
+        if (kills.len == KILL_BATCH_MAX) {
+            flushKills(ctx);
+        }
+        RedisModule_RetainString(ctx, key);
+        kills.keys[kills.len++] = key;
+    }
+}
+
+/* Schedule the next run of a fired timer, `interval` after `now`, or after its deadline if fixed rate.
+ * Master replicates the remaining TIMES as the command recreating the timer, so replicas and AOF
+ * run it exactly n times. Return false if it's done, a one-time timer or a loop timer after its last TIMES */
+static bool rescheduleLoop(RedisModuleCtx *ctx, TimerData *td, mstime_t now) {
+    if (!td->loop) return false;
+    bool times = td->ext & (1U << EXT_TIMES);
+    if (times) {
+        int64_t left = extGet(td, EXT_TIMES) - 1;
+        if (left <= 0) return false;
+        extSet(td, EXT_TIMES, left);
+    }
+    if (td->rate == RATE_NONE) {
+        td->expire = now + td->interval;
+    } else {
+        td->expire += td->interval;
+        if (td->rate == RATE_SKIP && td->expire <= now) {
+            mstime_t missed = (now - td->expire) / td->interval + 1;
+            stats.periodsSkipped += missed;
+            td->expire += missed * td->interval;
+        }
+    }
+    wheelInsert(td);
+    if (times && isMaster) {
+        TimerSet *set = timerOwner(td);
+        emitTimer(ctx, NULL, set ? set->key : NULL, td);
+    }
+    return true;
+}
+
+/* delete a fired one-time timer named `key` from the selected db, and replicate the deletion */
+static void deleteFiredTimer(RedisModuleCtx *ctx, TimerData *td, RedisModuleString *key) {
+    TimerSet *set = timerOwner(td);
+    replicateKill(ctx, set, key);
+    if (set) {
+        size_t len;
+        const char *member = RedisModule_StringPtrLen(key, &len);
+        removeSetMember(ctx, set, member, len);
+    } else {
+        RedisModuleKey *mk = RedisModule_OpenKey(ctx, key, REDISMODULE_WRITE);
+        RedisModule_DeleteKey(mk); /* timer is freed by free callback */
+        RedisModule_CloseKey(mk);
+    }
+}
+
+/* trim and close the streams opened by stream timers, trimming is replicated as the exact
+ * length, so replicas end up with the same entries whatever the approximation */
+static void flushStreamSinks(RedisModuleCtx *ctx) {
+    for (int i = 0; i < sinks.len; i++) {
+        StreamSink *sink = &sinks.streams[i];
+        if (sink->maxlen > 0) {
+            int flags = sink->approx ? REDISMODULE_STREAM_TRIM_APPROX : 0;
+            if (RedisModule_StreamTrimByLength(sink->key, flags, sink->maxlen) > 0) {
+                long long len = (long long)RedisModule_ValueLength(sink->key);
+                RedisModule_Replicate(ctx, "XTRIM", "scl", sink->name, "MAXLEN", len);
+            }
+        }
+        RedisModule_CloseKey(sink->key);
+        RedisModule_FreeString(ctx, sink->name);
+    }
+    sinks.len = 0;
+}
+
+/* the opened stream `name` in the selected db, NULL if the key holds something else */
+static StreamSink *openStreamSink(RedisModuleCtx *ctx, RedisModuleString *name) {
+    for (int i = 0; i < sinks.len; i++) {
+        if (RedisModule_StringCompare(sinks.streams[i].name, name) == 0) {
+            return &sinks.streams[i];
+        }
+    }
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, name, REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && type != REDISMODULE_KEYTYPE_STREAM) {
+        RedisModule_CloseKey(key);
+        return NULL;
+    }
+    if (sinks.len == STREAM_SINKS) {
+        flushStreamSinks(ctx);
+    }
+    StreamSink *sink = &sinks.streams[sinks.len++];
+    RedisModule_RetainString(ctx, name);
+    sink->name = name;
+    sink->key = key;
+    sink->maxlen = 0;
+    sink->approx = true;
+    return sink;
+}
+
+/* append the fields of a stream timer with an auto generated id, replicated as XADD with that id.
+ * Return false if `name` is not a stream, or the stream can't take more entries */
+static bool appendStreamSink(RedisModuleCtx *ctx, const TimerData *td, RedisModuleString *name, RedisModuleString **data) {
+    StreamSink *sink = openStreamSink(ctx, name);
+    if (!sink) return false;
+    RedisModuleStreamID id;
+    if (RedisModule_StreamAdd(sink->key, REDISMODULE_STREAM_ADD_AUTOID, &id, data, td->datalen / 2) != REDISMODULE_OK) {
+        return false;
+    }
+    char buf[48];
+    snprintf(buf, sizeof(buf), "%llu-%llu", (unsigned long long)id.ms, (unsigned long long)id.seq);
+    RedisModule_Replicate(ctx, "XADD", "scv", name, buf, data, (size_t)td->datalen);
+    RedisModule_NotifyKeyspaceEvent(ctx, REDISMODULE_NOTIFY_STREAM, "xadd", name);
+    if (td->ext & (1U << EXT_MAXLEN)) {
+        long long maxlen = extGet(td, EXT_MAXLEN);
+        bool approx = maxlen < 0;
+        if (approx) maxlen = -maxlen;
+        if (sink->maxlen == 0 || maxlen < sink->maxlen) {
+            sink->maxlen = maxlen;
+        }
+        sink->approx &= approx;
+    }
+    return true;
+}
+
+/* call the functions of the batched timers, streams are flushed first, scripts may touch them */
+static void flushCallBatches(RedisModuleCtx *ctx) {
+    if (!batcher.len) return;
+    flushKills(ctx);
+    flushStreamSinks(ctx);
+    for (int i = 0; i < batcher.len; i++) {
+        CallBatch *batch = &batcher.batches[i];
+        batch->args[0] = RedisModule_CreateStringFromLongLong(ctx, batch->count);
+        long long start = monotonicUs();
+        RedisModuleCallReply *reply = RedisModule_Call(ctx, "FCALL", "!slvv", batch->function, (long long)batch->numkeys,
+                                                       batch->keys, batch->numkeys, batch->args, batch->numargs);
+        bool failed = !reply || RedisModule_CallReplyType(reply) == REDISMODULE_REPLY_ERROR;
+        if (failed) stats.actionErrors++;
+        if (reply) RedisModule_FreeCallReply(reply);
+        long long duration = monotonicUs() - start;
+        histRecord(&actionDuration, duration);
+        recordExecution(ctx, batch->function, batch->count, duration, failed);
+        RedisModule_FreeString(ctx, batch->function);
+        for (size_t j = 0; j < batch->numkeys; j++) {
+            RedisModule_FreeString(ctx, batch->keys[j]);
+        }
+        for (size_t j = 0; j < batch->numargs; j++) {
+            RedisModule_FreeString(ctx, batch->args[j]);
+        }
+        RedisModule_Free(batch->keys);
+        RedisModule_Free(batch->args);
+    }
+    batcher.len = 0;
+}
+
+/* make room for `n` more strings in `*array` */
+static void reserveStrings(RedisModuleString ***array, size_t len, size_t *cap, size_t n) {
+    if (len + n <= *cap) return;
+    *cap = len + n > *cap * 2 ? len + n : *cap * 2;
+    *array = RedisModule_Realloc(*array, sizeof(RedisModuleString*) * (*cap));
+}
+
+/* add the keys & args of a fired batch timer to the batch of its function, strings are retained */
+static void appendCallBatch(RedisModuleCtx *ctx, RedisModuleString *function, int numkeys, RedisModuleString **data, int datalen) {
+    CallBatch *batch = NULL;
+    int slot = numkeys > 0 && RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_CLUSTER ? keySlot(data[0]) : -1;
+    for (int i = 0; i < batcher.len; i++) {
+        CallBatch *b = &batcher.batches[i];
+        if ((slot == -1 || b->slot == -1 || b->slot == slot) && RedisModule_StringCompare(b->function, function) == 0) {
+            batch = b;
+            if (slot != -1) batch->slot = slot;
+            break;
+        }
+    }
+    if (!batch) {
+        if (batcher.len == CALL_BATCHES) {
+            flushCallBatches(ctx);
+        }
+        batch = &batcher.batches[batcher.len++];
+        memset(batch, 0, sizeof(*batch));
+        RedisModule_RetainString(ctx, function);
+        batch->function = function;
+        batch->slot = slot;
+        reserveStrings(&batch->args, 0, &batch->argscap, 1);
+        batch->args[batch->numargs++] = NULL; /* count, set when called */
+    }
+    reserveStrings(&batch->keys, batch->numkeys, &batch->keyscap, numkeys);
+    reserveStrings(&batch->args, batch->numargs, &batch->argscap, 2 + datalen - numkeys);
+    for (int i = 0; i < numkeys; i++) {
+        RedisModule_RetainString(ctx, data[i]);
+        batch->keys[batch->numkeys++] = data[i];
+    }
+    batch->args[batch->numargs++] = RedisModule_CreateStringFromLongLong(ctx, numkeys);
+    batch->args[batch->numargs++] = RedisModule_CreateStringFromLongLong(ctx, datalen - numkeys);
+    for (int i = numkeys; i < datalen; i++) {
+        RedisModule_RetainString(ctx, data[i]);
+        batch->args[batch->numargs++] = data[i];
+    }
+    if (++batch->count >= CALL_BATCH_MAX) {
+        flushCallBatches(ctx);
+    }
+}
+
+static PollQueue *getPollQueue(int dbid, const char *name, size_t len, bool create) {
+    PollQueue *queue = RedisModule_DictGetC(poller.queues[dbid], (void *)name, len, NULL);
+    if (!queue && create) {
+        queue = RedisModule_Calloc(1, sizeof(*queue) + len);
+        memcpy(queue->name, name, len);
+        queue->len = len;
+        queue->dbid = dbid;
+        RedisModule_DictSetC(poller.queues[dbid], queue->name, len, queue);
+    }
+    return queue;
+}
+
+/* free the queue if nothing in it */
+static void tryFreePollQueue(PollQueue *queue) {
+    if (queue->due.head || queue->head || queue->pending) return;
+    RedisModule_DictDelC(poller.queues[queue->dbid], queue->name, queue->len, NULL);
+    RedisModule_Free(queue);
+}
+
+/* take a timer off the schedule, the poll queue it was due in is freed if left empty */
+static void unscheduleTimer(TimerData *td) {
+    TimerList *list = td->list;
+    wheelRemove(td);
+    if (td->action != ACTION_POLL || !list || list->head) return;
+    size_t len;
+    const char *name = payloadAt(td, PAYLOAD_FUNCTION, &len);
+    PollQueue *queue = getPollQueue(td->dbid, name, len, false);
+    if (queue && list == &queue->due) tryFreePollQueue(queue);
+}
+
+/* detach a timer whose key is removed */
+static void unlinkTimer(TimerData *td) {
+    unscheduleTimer(td);
+    DetachTimerData(td);
+}
+
+/* put a fired poll timer in its queue, ordered by deadline, it's still in db until taken */
+static void pollQueueAdd(TimerData *td) {
+    size_t len;
+    const char *name = payloadAt(td, PAYLOAD_FUNCTION, &len);
+    PollQueue *queue = getPollQueue(td->dbid, name, len, true);
+    TimerList *due = &queue->due;
+    TimerData *prev = due->tail;
+    while (prev && prev->expire > td->expire) {
+        prev = prev->prev;
+    }
+    listInsertAfter(due, prev, td);
+    if (queue->head && !queue->pending) {
+        queue->pending = true;
+        queue->nextPending = poller.pending;
+        poller.pending = queue;
+    }
+}
+
+/* timers taken from a queue, key & data of each timer */
+typedef struct PollBatch {
+    int len;
+    int *datalen;
+    RedisModuleString **strs;
+} PollBatch;
+
+/* take at most `count` timers from the queue, its db must be selected.
+ * One-time timers are deleted, loop timers are scheduled again */
+static PollBatch *takePollTimers(RedisModuleCtx *ctx, PollQueue *queue, long long count) {
+    PollBatch *batch = RedisModule_Calloc(1, sizeof(*batch));
+    size_t nstrs = 0;
+    int n = 0;
+    for (TimerData *td = queue->due.head; td && n < count; td = td->next) {
+        nstrs += 1 + td->datalen;
+        n++;
+    }
+    batch->datalen = RedisModule_Alloc(sizeof(int) * (n + 1));
+    batch->strs = RedisModule_Alloc(sizeof(RedisModuleString*) * (nstrs + 1));
+    mstime_t now = monotonicMs();
+    RedisModuleString **strs = batch->strs;
+    while (batch->len < n) {
+        TimerData *td = queue->due.head;
+        RedisModuleString *key = payloadString(NULL, td, PAYLOAD_KEY);
+        batch->datalen[batch->len++] = td->datalen;
+        *strs++ = key;
+        payloadData(NULL, td, strs);
+        strs += td->datalen;
+        listRemove(td);
+        if (!rescheduleLoop(ctx, td, now)) {
+            deleteFiredTimer(ctx, td, key);
+        }
+    }
+    return batch;
+}
+
+static void freePollBatch(PollBatch *batch) {
+    RedisModuleString **strs = batch->strs;
+    for (int i = 0; i < batch->len; i++) {
+        for (int j = 0; j <= batch->datalen[i]; j++) {
+            RedisModule_FreeString(NULL, *strs++);
+        }
+    }
+    RedisModule_Free(batch->strs);
+    RedisModule_Free(batch->datalen);
+    RedisModule_Free(batch);
+}
+
+/* reply an array of [key, [arg ...]] */
+static void replyPollBatch(RedisModuleCtx *ctx, const PollBatch *batch) {
+    RedisModuleString **strs = batch->strs;
+    RedisModule_ReplyWithArray(ctx, batch->len);
+    for (int i = 0; i < batch->len; i++) {
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithString(ctx, *strs++);
+        RedisModule_ReplyWithArray(ctx, batch->datalen[i]);
+        for (int j = 0; j < batch->datalen[i]; j++) {
+            RedisModule_ReplyWithString(ctx, *strs++);
+        }
+    }
+}
+
+static void removePollWaiter(PollWaiter *waiter) {
+    PollQueue *queue = waiter->queue;
+    if (waiter->prev) {
+        waiter->prev->next = waiter->next;
+    } else {
+        queue->head = waiter->next;
+    }
+    if (waiter->next) {
+        waiter->next->prev = waiter->prev;
+    } else {
+        queue->tail = waiter->prev;
+    }
+    RedisModule_DictDelC(poller.waiters, &waiter->bc, sizeof(waiter->bc), NULL);
+    RedisModule_Free(waiter);
+}
+
+/* hand the timers fired in this tick to the clients waiting for them */
+static void servePollQueues(RedisModuleCtx *ctx) {
+    while (poller.pending) {
+        PollQueue *queue = poller.pending;
+        poller.pending = queue->nextPending;
+        queue->pending = false;
+        RedisModule_SelectDb(ctx, queue->dbid);
+        while (queue->head && queue->due.head) {
+            PollWaiter *waiter = queue->head;
+            RedisModuleBlockedClient *bc = waiter->bc;
+            PollBatch *batch = takePollTimers(ctx, queue, waiter->count);
+            removePollWaiter(waiter);
+            RedisModule_UnblockClient(bc, batch);
+        }
+        tryFreePollQueue(queue);
+    }
+}
+
+/* fire an expired timer, `td` is already unscheduled and its db selected */
+void TimerCallback(RedisModuleCtx *ctx, TimerData *td) {
+    firing = td;
+    RedisModuleString *key = payloadString(ctx, td, PAYLOAD_KEY);
+    TimerSet *set = timerOwner(td);
+    RedisModule_KeyExists(ctx, set ? set->key : key);  // actively expire key
+    if (td->deleted) { /* just expired, clear it */
+        RedisModule_FreeString(ctx, key);
+        firing = NULL;
+        DeleteTimerData(td);
+        return;
+    }
+    Breaker *breaker = isMaster ? trippedBreaker(td) : NULL;
+    if (breaker && breakerPolicy == BREAKER_DEFER) {
+        RedisModule_FreeString(ctx, key);
+        firing = NULL;
+        deferTimer(&breaker->backlog, td);
+        stats.breakerDeferred++;
+        return;
+    }
+    if (!breaker) takeTokens(td);
+    stats.fired++;
+    histRecord(&fireLag, monotonicUs() - timerDeadline(td) * 1000);
+    if (jitterOffset(td)) stats.jittered++;
+    if (td->action == ACTION_POLL && (isMaster || !td->loop)) {
+        /* stays in db until taken by TIMER.POLL, replica waits for master's timer.kill,
+         * but keeps loop timers running as master reschedules them without replicating */
+        RedisModule_FreeString(ctx, key);
+        firing = NULL;
+        pollQueueAdd(td);
+        return;
+    }
+    /* if loop, and not done with its TIMES, reinsert
+     * if not, delete the timer data
+     */
+    if (!rescheduleLoop(ctx, td, monotonicMs())) {
+        // replica also delete timer data, there is a race condition between replica timer firing
+        // and receiving master's 'timer.kill' action
+        deleteFiredTimer(ctx, td, key);
+        // freeing `td` is deferred after function execution
+        RedisModule_Assert(td->deleted);
+    }
+    // execution at last to avoid function making `td` invalid (e.g. timer.kill `key` in function)
+    // also make interval more reliable for loop timer with slow function
+    RedisModule_FreeString(ctx, key);
+    if (breaker) {
+        // tripped with the drop policy, the timer is consumed without its action
+        breaker->dropped++;
+        stats.breakerDropped++;
+    } else if (isMaster) {
+        // if master, execute the action, replica will copy master's actions
+        // arguments are built before the call, function may invalidate `td`
+        RedisModuleString *function = payloadString(ctx, td, PAYLOAD_FUNCTION);
+        RedisModuleString **data = RedisModule_Alloc(sizeof(RedisModuleString*)*(td->datalen+1));
+        int numkeys = td->numkeys, datalen = td->datalen;
+        payloadData(ctx, td, data);
+        long long start = monotonicUs();
+        if (td->action == ACTION_BATCH) {
+            appendCallBatch(ctx, function, numkeys, data, datalen); /* duration is recorded when called */
+        } else if (td->action == ACTION_STREAM) {
+            if (!appendStreamSink(ctx, td, function, data)) stats.actionErrors++;
+            histRecord(&actionDuration, monotonicUs() - start);
+        } else {
+            RedisModuleCallReply *reply;
+            flushKills(ctx);
+            flushStreamSinks(ctx);
+            if (td->action == ACTION_COMMAND) {
+                reply = RedisModule_Call(ctx, RedisModule_StringPtrLen(function, NULL), "!v", data, (size_t)datalen);
+            } else {
+                reply = RedisModule_Call(ctx, "FCALL", "!slv", function, (long long)numkeys, data, (size_t)datalen);
+            }
+            bool failed = !reply || RedisModule_CallReplyType(reply) == REDISMODULE_REPLY_ERROR;
+            if (failed) stats.actionErrors++;
+            if (reply) RedisModule_FreeCallReply(reply);
+            long long duration = monotonicUs() - start;
+            histRecord(&actionDuration, duration);
+            recordExecution(ctx, function, 1, duration, failed);
+        }
+        RedisModule_FreeString(ctx, function);
+        for (int i = 0; i < datalen; i++) {
+            RedisModule_FreeString(ctx, data[i]);
+        }
+        RedisModule_Free(data);
+    }
+    firing = NULL;
+    if (td->deleted) {
+        // one-time timer, or loop timer deleted by the function
+        DeleteTimerData(td);
+    }
+}
+
+/* select `dbid` to fire its timers, the batched actions of the previous db are flushed first */
+static void selectDispatchDb(RedisModuleCtx *ctx, int *selected, int dbid) {
+    if (*selected == dbid) return;
+    if (*selected >= 0) {
+        flushCallBatches(ctx);
+        flushStreamSinks(ctx);
+        flushKills(ctx);
+    }
+    RedisModule_SelectDb(ctx, dbid);
+    *selected = dbid;
+}
+
+/* callback of the module timer driving the wheel, fire expired timers db by db in one context,
+ * stop when `dispatchBudget` is used up and leave the rest to the next event loop.
+ * Timers deferred by the rate limits go first, in deadline order, as far as the buckets refilled */
+void WheelCallback(RedisModuleCtx *ctx, void *data) {
+    REDISMODULE_NOT_USED(data);
+    wheel.armed = 0;
+    wheelAdvance(monotonicMs());
+    releaseBreakerTrials(wheel.now);
+    kills.deferred = true;
+    long long start = monotonicUs();
+    long long deadline = dispatchBudget > 0 ? start + dispatchBudget : LLONG_MAX;
+    DeadlineSet exact = {0}, slacked = {0};
+    long long fired = 0;
+    int selected = -1;
+    TimerData *td;
+    RateLimit *limit;
+    refillLimits(start);
+    while ((td = nextDeferred(&limit)) != NULL) {
+        releaseDeferred(limit, td, wheel.now);
+        selectDispatchDb(ctx, &selected, td->dbid);
+        TimerCallback(ctx, td);
+        fired++;
+        if (monotonicUs() >= deadline) goto out;
+    }
+    for (int i = 0; i < dispatcher.dbnum; i++) {
+        int dbid = (dispatcher.cursor + i) % dispatcher.dbnum;
+        TimerList *ready = &dispatcher.ready[dbid];
+        while (ready->head) {
+            td = ready->head;
+            listRemove(td);
+            if (!limitTimer(td)) continue;
+            deadlineSetAdd(&exact, td->expire + jitterOffset(td));
+            deadlineSetAdd(&slacked, timerDeadline(td));
+            selectDispatchDb(ctx, &selected, dbid);
+            TimerCallback(ctx, td);
+            fired++;
+            if (monotonicUs() >= deadline) {
+                dispatcher.cursor = dbid;
+                goto out;
+            }
+        }
+    }
+out:
+    flushCallBatches(ctx);
+    flushStreamSinks(ctx);
+    flushKills(ctx);
+    kills.deferred = false;
+    servePollQueues(ctx);
+    stats.wakeups++;
+    stats.wakeupsSaved += exact.distinct - slacked.distinct;
+    deadlineSetFree(&exact);
+    deadlineSetFree(&slacked);
+    histRecord(&wakeupFires, fired);
+    wheelArm(ctx);
+}
+
+
+/* move the deadline of `td` to `expire` in place, a fired POLL timer not taken yet is scheduled again */
+static void touchTimer(TimerData *td, mstime_t expire) {
+    unscheduleTimer(td);
+    td->expire = expire;
+    wheelInsert(td);
+}
+
+/* replicate moving the deadline of timer `key` as TIMER.TOUCH with the deadline of master */
+static void replicateTouch(RedisModuleCtx *ctx, RedisModuleString *key, mstime_t expire) {
+    RedisModule_Replicate(ctx, "timer.touch", "scl", key, "PXAT", RedisModule_Milliseconds() + expire - monotonicMs());
+}
+
+/* RENAME and MOVE delete the old key after adding the value to the new one, the unlink callback
+ * detached the timer of a key that still exists, count it as live again, the caller schedules it */
+static void undoDetach(TimerData *td) {
+    if (!td->deleted) return;
+    td->deleted = false;
+    __atomic_fetch_sub(&zombies, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&stats.dbs[td->dbid].zombies, 1, __ATOMIC_RELAXED);
+    countTimer(td, 1);
+}
+
+/* move a timer to db `dbid` and schedule it again, a fired POLL timer not taken yet fires again */
+static void moveTimer(TimerData *td, int dbid) {
+    undoDetach(td);
+    unscheduleTimer(td); /* may be in the ready list or a poll queue of the old db */
+    countTimer(td, -1);
+    td->dbid = dbid;
+    countTimer(td, 1);
+    wheelInsert(td);
+}
+
+int keyEventsCallback(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *key) {
+    RedisModule_AutoMemory(ctx);
+    REDISMODULE_NOT_USED(type);
+    if (strcasecmp(event, "rename_to") == 0) {
+        RedisModuleKey *mk = RedisModule_OpenKey(ctx, key, REDISMODULE_WRITE);
+        if (RedisModule_ModuleTypeGetType(mk) == moduleType) {
+            /* key is packed in the payload, replace the value with a copy carrying the new key */
+            TimerData *td = RedisModule_ModuleTypeGetValue(mk);
+            size_t klen, oklen;
+            const char *k = RedisModule_StringPtrLen(key, &klen);
+            payloadAt(td, PAYLOAD_KEY, &oklen);
+            size_t rest = td->size - payloadLen(oklen);
+            TimerData *renamed = CreateTimerData(payloadLen(klen) + rest);
+            renamed->expire = td->expire;
+            renamed->interval = td->interval;
+            renamed->datalen = td->datalen;
+            renamed->numkeys = td->numkeys;
+            renamed->dbid = td->dbid;
+            renamed->loop = td->loop;
+            renamed->rate = td->rate;
+            renamed->action = td->action;
+            renamed->ext = td->ext;
+            char *p = payloadAppend(renamed->payload, k, klen);
+            memcpy(p, td->payload + payloadLen(oklen), rest);
+            payloadRefs(renamed, true);
+            if (renamed->ext & (1U << EXT_HASH)) {
+                extSet(renamed, EXT_HASH, (int64_t)keyHash(renamed)); /* the jitter offset follows the new key */
+            }
+            wheelInsert(renamed); /* `td` is already detached by the unlink of the old key */
+            wheelArm(ctx);
+            DetachTimerData(td);
+            countTimer(renamed, 1);
+            RedisModule_ModuleTypeReplaceValue(mk, moduleType, renamed, NULL);
+            ReleaseTimerData(td);
+        } else if (RedisModule_ModuleTypeGetType(mk) == setType) {
+            /* members are named independently of the key, only the set knows it */
+            TimerSet *set = RedisModule_ModuleTypeGetValue(mk);
+            RedisModule_FreeString(NULL, set->key);
+            set->key = RedisModule_CreateStringFromString(NULL, key);
+            /* members were detached by the unlink of the old key */
+            RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(set->members, "^", NULL, 0);
+            TimerData *td;
+            while (RedisModule_DictNextC(iter, NULL, (void **)&td)) {
+                if (td->deleted) {
+                    undoDetach(td);
+                    wheelInsert(td);
+                }
+            }
+            RedisModule_DictIteratorStop(iter);
+            wheelArm(ctx);
+        }
+    } else if (strcasecmp(event, "move_to") == 0) {
+        RedisModuleKey *mk = RedisModule_OpenKey(ctx, key, REDISMODULE_READ);
+        int dbid = RedisModule_GetSelectedDb(ctx);
+        if (RedisModule_ModuleTypeGetType(mk) == moduleType) {
+            moveTimer(RedisModule_ModuleTypeGetValue(mk), dbid);
+            wheelArm(ctx);
+        } else if (RedisModule_ModuleTypeGetType(mk) == setType) {
+            TimerSet *set = RedisModule_ModuleTypeGetValue(mk);
+            RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(set->members, "^", NULL, 0);
+            TimerData *td;
+            while (RedisModule_DictNextC(iter, NULL, (void **)&td)) {
+                moveTimer(td, dbid);
+            }
+            RedisModule_DictIteratorStop(iter);
+            wheelArm(ctx);
+        }
+    }
+    return REDISMODULE_OK;
+}
+
+/* conditions of TIMER.NEW on the timer it replaces, like the ones of SET and EXPIRE */
+enum {
+    COND_NX = 1 << 0,           /* only if the timer doesn't exist */
+    COND_XX = 1 << 1,           /* only if the timer exists */
+    COND_GT = 1 << 2,           /* only if the new deadline is later, or the timer doesn't exist */
+    COND_LT = 1 << 3,           /* only if the new deadline is earlier, or the timer doesn't exist */
+    COND_GET = 1 << 4,          /* reply the remaining time of the old timer */
+    COND_DEBOUNCE = 1 << 5,     /* only move the deadline of the old timer, keeping its function and args */
+};
+
+/* options of TIMER.NEW and TIMER.MNEW, from milliseconds to numkeys */
+typedef struct TimerOptions {
+    mstime_t interval;
+    mstime_t deadline;          /* first deadline in unix milliseconds if PXAT, else 0 and it's `interval` from now */
+    int cond;                   /* COND_* flags */
+    int end;                    /* index of numkeys in argv */
+    bool loop;
+    TimerRate rate;
+    TimerAction action;
+    uint8_t ext;                /* optional fields present */
+    int64_t extv[EXT_FIELDS];   /* values of the optional fields */
+} TimerOptions;
+
+/* set an optional field of the timer to create */
+static void setTimerOption(TimerOptions *opts, int field, int64_t v) {
+    opts->ext |= 1U << field;
+    opts->extv[field] = v;
+}
+
+/* Parse `milliseconds [NX | XX] [GT | LT] [GET] [DEBOUNCE] [PXAT unix-ms] [LOOP] [RATE [SKIP | BURST]] [TIMES n] [JITTER ms] [SLACK ms] [CMD | STREAM [MAXLEN [~|=] count] | POLL | BATCH] numkeys`
+ * from argv[*pos], `*pos` is moved past numkeys.
+ * On error `err` is set to the reply, or NULL if it's wrong arity */
+static int parseTimerOptions(RedisModuleString **argv, int argc, int *pos, TimerOptions *opts, long long *numkeys, const char **err) {
+    *err = NULL;
+    if (*pos >= argc) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[*pos], &opts->interval) != REDISMODULE_OK || opts->interval <= 0) {
+        *err = "ERR invalid interval";
+        return REDISMODULE_ERR;
+    }
+    opts->deadline = 0;
+    opts->cond = 0;
+    opts->loop = false;
+    opts->rate = RATE_NONE;
+    opts->action = ACTION_FCALL;
+    opts->ext = 0;
+    for ((*pos)++; *pos < argc; (*pos)++) {
+        const char *s = RedisModule_StringPtrLen(argv[*pos], NULL);
+        if (strcasecmp(s, "LOOP") == 0) {
+            opts->loop = true;
+        } else if (strcasecmp(s, "RATE") == 0) {
+            opts->loop = true;
+            opts->rate = RATE_SKIP;
+            if (*pos + 1 < argc) {
+                const char *policy = RedisModule_StringPtrLen(argv[*pos + 1], NULL);
+                if (strcasecmp(policy, "SKIP") == 0 || strcasecmp(policy, "BURST") == 0) {
+                    opts->rate = strcasecmp(policy, "SKIP") == 0 ? RATE_SKIP : RATE_BURST;
+                    (*pos)++;
+                }
+            }
+        } else if (strcasecmp(s, "TIMES") == 0) {
+            long long times;
+            if (++(*pos) >= argc) {
+                return REDISMODULE_ERR;
+            }
+            if (RedisModule_StringToLongLong(argv[*pos], &times) != REDISMODULE_OK || times <= 0) {
+                *err = "ERR invalid times";
+                return REDISMODULE_ERR;
+            }
+            opts->loop = true;
+            setTimerOption(opts, EXT_TIMES, times);
+        } else if (strcasecmp(s, "JITTER") == 0) {
+            long long jitter;
+            if (++(*pos) >= argc) {
+                return REDISMODULE_ERR;
+            }
+            if (RedisModule_StringToLongLong(argv[*pos], &jitter) != REDISMODULE_OK || jitter < 0) {
+                *err = "ERR invalid jitter";
+                return REDISMODULE_ERR;
+            }
+            setTimerOption(opts, EXT_JITTER, jitter);
+        } else if (strcasecmp(s, "NX") == 0) {
+            opts->cond |= COND_NX;
+        } else if (strcasecmp(s, "XX") == 0) {
+            opts->cond |= COND_XX;
+        } else if (strcasecmp(s, "GT") == 0) {
+            opts->cond |= COND_GT;
+        } else if (strcasecmp(s, "LT") == 0) {
+            opts->cond |= COND_LT;
+        } else if (strcasecmp(s, "GET") == 0) {
+            opts->cond |= COND_GET;
+        } else if (strcasecmp(s, "DEBOUNCE") == 0) {
+            opts->cond |= COND_DEBOUNCE;
+        } else if (strcasecmp(s, "PXAT") == 0) {
+            if (++(*pos) >= argc) {
+                return REDISMODULE_ERR;
+            }
+            if (RedisModule_StringToLongLong(argv[*pos], &opts->deadline) != REDISMODULE_OK || opts->deadline <= 0) {
+                *err = "ERR invalid deadline";
+                return REDISMODULE_ERR;
+            }
+        } else if (strcasecmp(s, "CMD") == 0 || strcasecmp(s, "STREAM") == 0 || strcasecmp(s, "POLL") == 0 ||
+                   strcasecmp(s, "BATCH") == 0) {
+            if (opts->action != ACTION_FCALL) {
+                *err = "ERR CMD, STREAM, POLL and BATCH are mutually exclusive";
+                return REDISMODULE_ERR;
+            }
+            opts->action = strcasecmp(s, "CMD") == 0 ? ACTION_COMMAND :
+                           strcasecmp(s, "STREAM") == 0 ? ACTION_STREAM :
+                           strcasecmp(s, "POLL") == 0 ? ACTION_POLL : ACTION_BATCH;
+        } else if (strcasecmp(s, "SLACK") == 0) {
+            long long slack;
+            if (++(*pos) >= argc) {
+                return REDISMODULE_ERR;
+            }
+            if (RedisModule_StringToLongLong(argv[*pos], &slack) != REDISMODULE_OK || slack < 0) {
+                *err = "ERR invalid slack";
+                return REDISMODULE_ERR;
+            }
+            if (slack > 0) {
+                setTimerOption(opts, EXT_SLACK, slack);
+            }
+        } else if (strcasecmp(s, "MAXLEN") == 0) {
+            bool approx = false;
+            long long maxlen;
+            if (*pos + 1 < argc) {
+                const char *mode = RedisModule_StringPtrLen(argv[*pos + 1], NULL);
+                if (strcmp(mode, "~") == 0 || strcmp(mode, "=") == 0) {
+                    approx = mode[0] == '~';
+                    (*pos)++;
+                }
+            }
+            if (++(*pos) >= argc) {
+                return REDISMODULE_ERR;
+            }
+            if (RedisModule_StringToLongLong(argv[*pos], &maxlen) != REDISMODULE_OK || maxlen <= 0) {
+                *err = "ERR invalid maxlen";
+                return REDISMODULE_ERR;
+            }
+            setTimerOption(opts, EXT_MAXLEN, approx ? -maxlen : maxlen);
+        } else {
+            break;
+        }
+    }
+    if (*pos >= argc) {
+        return REDISMODULE_ERR;
+    }
+    if ((opts->ext & (1U << EXT_MAXLEN)) && opts->action != ACTION_STREAM) {
+        *err = "ERR MAXLEN requires STREAM";
+        return REDISMODULE_ERR;
+    }
+    int cond = opts->cond;
+    if ((cond & COND_NX && cond & (COND_XX | COND_GT | COND_LT)) || (cond & COND_GT && cond & COND_LT)) {
+        *err = "ERR NX and XX, GT or LT options at the same time are not compatible";
+        return REDISMODULE_ERR;
+    }
+    opts->end = *pos;
+    if (RedisModule_StringToLongLong(argv[*pos], numkeys) != REDISMODULE_OK || *numkeys < 0) {
+        *err = "ERR invalid numkeys";
+        return REDISMODULE_ERR;
+    }
+    if ((opts->action == ACTION_STREAM || opts->action == ACTION_POLL) && *numkeys != 0) {
+        *err = "ERR numkeys of STREAM and POLL should be 0";
+        return REDISMODULE_ERR;
+    }
+    (*pos)++;
+    return REDISMODULE_OK;
+}
+
+/* data of a stream timer should be field value pairs */
+static bool validTimerData(const TimerOptions *opts, long long datalen) {
+    return opts->action != ACTION_STREAM || (datalen > 0 && datalen % 2 == 0);
+}
+
+/* hash slot of a key in cluster, only the {hashtag} is hashed if any */
+static int keySlot(const RedisModuleString *key) {
+    size_t len;
+    const char *s = RedisModule_StringPtrLen(key, &len);
+    const char *open = memchr(s, '{', len);
+    if (open) {
+        const char *close = memchr(open + 1, '}', len - (size_t)(open + 1 - s));
+        if (close && close > open + 1) {
+            s = open + 1;
+            len = (size_t)(close - s);
+        }
+    }
+    uint16_t crc = 0; /* CRC16 XMODEM like redis cluster */
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)((unsigned char)s[i] << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 0x8000 ? (uint16_t)(crc << 1 ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc & 16383;
+}
+
+/* in cluster a poll timer must be in the slot of its queue, TIMER.POLL only reaches that slot */
+static bool validPollKey(RedisModuleCtx *ctx, const TimerOptions *opts, RedisModuleString *key, RedisModuleString *queue) {
+    return opts->action != ACTION_POLL || !(RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_CLUSTER) ||
+           keySlot(key) == keySlot(queue);
+}
+
+/* the COMMAND INFO entry of `name`, NULL if no such command, `reply` is to be freed by caller */
+static RedisModuleCallReply *commandInfo(RedisModuleCtx *ctx, RedisModuleString *name, RedisModuleCallReply **reply) {
+    *reply = RedisModule_Call(ctx, "COMMAND", "cs", "INFO", name);
+    RedisModuleCallReply *info = *reply ? RedisModule_CallReplyArrayElement(*reply, 0) : NULL;
+    return RedisModule_CallReplyType(info) == REDISMODULE_REPLY_ARRAY ? info : NULL;
+}
+
+/* A CMD timer runs its command later without the user who created it, so check it once when created:
+ * it must exist, not be admin, blocking or noscript, and the user must be allowed to run it with these args.
+ * Commands of master and AOF were checked when first created. Return NULL if allowed, or the error */
+static const char *checkTimerCommand(RedisModuleCtx *ctx, const TimerOptions *opts, RedisModuleString *function,
+                                     RedisModuleString **data, int datalen) {
+    if (opts->action != ACTION_COMMAND ||
+        RedisModule_GetContextFlags(ctx) & (REDISMODULE_CTX_FLAGS_REPLICATED | REDISMODULE_CTX_FLAGS_LOADING)) {
+        return NULL;
+    }
+    RedisModuleCallReply *reply;
+    RedisModuleCallReply *info = commandInfo(ctx, function, &reply);
+    RedisModuleCallReply *subs = info ? RedisModule_CallReplyArrayElement(info, 9) : NULL;
+    if (datalen > 0 && subs && RedisModule_CallReplyLength(subs) > 0) {
+        /* a container like CONFIG, flags are those of the subcommand */
+        RedisModuleString *name = RedisModule_CreateStringPrintf(ctx, "%s|%s", RedisModule_StringPtrLen(function, NULL),
+                                                                 RedisModule_StringPtrLen(data[0], NULL));
+        if (reply) RedisModule_FreeCallReply(reply);
+        info = commandInfo(ctx, name, &reply);
+        RedisModule_FreeString(ctx, name);
+    }
+    const char *err = info ? NULL : "ERR unknown command for CMD";
+    RedisModuleCallReply *flags = info ? RedisModule_CallReplyArrayElement(info, 2) : NULL;
+    for (size_t i = 0; flags && !err && i < RedisModule_CallReplyLength(flags); i++) {
+        size_t len;
+        const char *flag = RedisModule_CallReplyStringPtr(RedisModule_CallReplyArrayElement(flags, i), &len);
+        if ((len == 5 && !memcmp(flag, "admin", 5)) || (len == 8 && !memcmp(flag, "blocking", 8)) ||
+            (len == 8 && !memcmp(flag, "noscript", 8))) {
+            err = "ERR CMD can't run admin, blocking or noscript commands";
+        }
+    }
+    if (reply) RedisModule_FreeCallReply(reply);
+    if (err) return err;
+    RedisModuleString *username = RedisModule_GetCurrentUserName(ctx);
+    RedisModuleUser *user = username ? RedisModule_GetModuleUserFromUserName(username) : NULL;
+    if (user) {
+        RedisModuleString **argv = RedisModule_Alloc(sizeof(RedisModuleString*) * (datalen + 1));
+        argv[0] = function;
+        memcpy(argv + 1, data, sizeof(RedisModuleString*) * datalen);
+        if (RedisModule_ACLCheckCommandPermissions(user, argv, datalen + 1) != REDISMODULE_OK) {
+            err = "NOPERM this user has no permissions to run the command of CMD";
+        }
+        RedisModule_Free(argv);
+        RedisModule_FreeModuleUser(user);
+    }
+    if (username) RedisModule_FreeString(ctx, username);
+    return err;
+}
+
+/* apply the options to a newly created timer, payload strings are already packed */
+static void applyTimerOptions(TimerData *td, const TimerOptions *opts) {
+    td->interval = opts->interval;
+    td->loop = opts->loop;
+    td->rate = opts->loop ? opts->rate : RATE_NONE;
+    td->action = opts->action;
+    td->ext = opts->ext;
+    for (int field = 0; field < EXT_FIELDS; field++) {
+        if (opts->ext & (1U << field)) {
+            extSet(td, field, opts->extv[field]);
+        }
+    }
+    if (td->ext & (1U << EXT_HASH)) {
+        extSet(td, EXT_HASH, (int64_t)keyHash(td)); /* the key is in the payload now */
+    }
+}
+
+/* keep the hash of the key in the timer if jitter applies to it, it's set by applyTimerOptions */
+static void addJitterHash(TimerOptions *opts) {
+    long long jitter = opts->ext & (1U << EXT_JITTER) ? opts->extv[EXT_JITTER] : defaultJitter;
+    if (jitter > 0) {
+        opts->ext |= 1U << EXT_HASH;
+    }
+}
+
+/* the first deadline of timers created now, monotonic */
+static mstime_t firstExpire(const TimerOptions *opts) {
+    mstime_t now = monotonicMs();
+    return opts->deadline ? now + opts->deadline - RedisModule_Milliseconds() : now + opts->interval;
+}
+
+/* Replicate the command creating timers with `PXAT deadline` after the interval at argv[pos], unless given,
+ * so that replicas and AOF get the deadline of master however late they apply it.
+ * Conditions are dropped, they are decided by master */
+static void replicateWithDeadline(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, int pos, const TimerOptions *opts) {
+    if (opts->deadline && !opts->cond) {
+        RedisModule_ReplicateVerbatim(ctx);
+        return;
+    }
+    RedisModuleString **args = RedisModule_Alloc(sizeof(RedisModuleString*) * (argc + 1));
+    int n = 0;
+    for (int i = 1; i < argc; i++) {
+        if (opts->cond && i > pos && i < opts->end) {
+            const char *s = RedisModule_StringPtrLen(argv[i], NULL);
+            if (!strcasecmp(s, "NX") || !strcasecmp(s, "XX") || !strcasecmp(s, "GT") || !strcasecmp(s, "LT") ||
+                !strcasecmp(s, "GET") || !strcasecmp(s, "DEBOUNCE")) {
+                continue;
+            }
+        }
+        args[n++] = argv[i];
+        if (i == pos && !opts->deadline) {
+            args[n++] = RedisModule_CreateString(ctx, "PXAT", 4);
+            args[n++] = RedisModule_CreateStringFromLongLong(ctx, RedisModule_Milliseconds() + opts->interval);
+        }
+    }
+    RedisModule_Replicate(ctx, RedisModule_StringPtrLen(argv[0], NULL), "v", args, (size_t)n);
+    RedisModule_Free(args);
+}
+
+/* Create a timer named `key` in the selected db and schedule it at `expire`.
+ * Key, function & data are packed in one allocation */
+static TimerData *createTimer(RedisModuleCtx *ctx, RedisModuleString *key, RedisModuleString *function, const TimerOptions *opts,
+                              int numkeys, RedisModuleString **data, int datalen, mstime_t expire) {
+    const char *stackStrs[PACK_STACK], **strs = stackStrs;
+    size_t stackLens[PACK_STACK] = {0}, *lens = stackLens;
+    if (datalen+2 > PACK_STACK) {
+        strs = RedisModule_Alloc(sizeof(*strs) * (datalen+2));
+        lens = RedisModule_Alloc(sizeof(*lens) * (datalen+2));
+    }
+    for (int i = 0; i < datalen+2; i++) {
+        strs[i] = RedisModule_StringPtrLen(i == 0 ? key : i == 1 ? function : data[i-2], &lens[i]);
+    }
+    TimerOptions hashed = *opts;
+    addJitterHash(&hashed);
+    TimerData *td = packTimerData(strs, lens, datalen+2, extSize(hashed.ext));
+    if (strs != stackStrs) {
+        RedisModule_Free(strs);
+        RedisModule_Free(lens);
+    }
+    applyTimerOptions(td, &hashed);
+    td->datalen = datalen;
+    td->numkeys = numkeys;
+
+    /* schedule the timer in the wheel */
+    td->expire = expire;
+    td->dbid = RedisModule_GetSelectedDb(ctx);
+    countTimer(td, 1);
+    wheelInsert(td);
+    return td;
+}
+
+/* Create a timer of `key` in the selected db, scheduled at `expire`.
+ * Return 1 if new timer created, 0 if replace old timer */
+static int newTimer(RedisModuleCtx *ctx, RedisModuleString *key, RedisModuleString *function, const TimerOptions *opts,
+                    int numkeys, RedisModuleString **data, int datalen, mstime_t expire) {
+    TimerData *td = createTimer(ctx, key, function, opts, numkeys, data, datalen, expire);
+    RedisModuleKey *mk = RedisModule_OpenKey(ctx, key, REDISMODULE_WRITE);
+    bool reset = RedisModule_ModuleTypeGetType(mk) == moduleType;
+    RedisModule_ModuleTypeSetValue(mk, moduleType, td); /* old timer is freed by free callback */
+    RedisModule_CloseKey(mk);
+    return reset ? 0 : 1;
+}
+
+/* Add timer `member` to the set of `key` in the selected db, the set is created if not exists.
+ * Return 1 if new member added, 0 if replace old member, -1 if `key` is not a timer set */
+static int addSetMember(RedisModuleCtx *ctx, RedisModuleString *key, RedisModuleString *member, RedisModuleString *function,
+                        const TimerOptions *opts, int numkeys, RedisModuleString **data, int datalen, mstime_t expire) {
+    RedisModuleKey *mk = RedisModule_OpenKey(ctx, key, REDISMODULE_WRITE);
+    TimerSet *set;
+    if (RedisModule_KeyType(mk) == REDISMODULE_KEYTYPE_EMPTY) {
+        set = createTimerSet(key);
+        RedisModule_ModuleTypeSetValue(mk, setType, set);
+    } else if (RedisModule_ModuleTypeGetType(mk) == setType) {
+        set = RedisModule_ModuleTypeGetValue(mk);
+    } else {
+        RedisModule_CloseKey(mk);
+        return -1;
+    }
+    RedisModule_CloseKey(mk);
+    TimerOptions owned = *opts;
+    setTimerOption(&owned, EXT_OWNER, (int64_t)(intptr_t)set);
+    TimerData *td = createTimer(ctx, member, function, &owned, numkeys, data, datalen, expire), *old;
+    size_t len;
+    const char *name = RedisModule_StringPtrLen(member, &len);
+    bool reset = RedisModule_DictDelC(set->members, (void *)name, len, &old) == REDISMODULE_OK;
+    if (reset) {
+        unlinkTimer(old);
+        ReleaseTimerData(old);
+    }
+    RedisModule_DictSetC(set->members, (void *)name, len, td);
+    return reset ? 0 : 1;
+}
+
+/* Kill the timer of `key` in the selected db.
+ * Return 1 if a timer been kill, 0 if not exists, -1 if not a timer */
+static int killTimer(RedisModuleCtx *ctx, RedisModuleString *key) {
+    if (!RedisModule_KeyExists(ctx, key)) {
+        return 0;
+    }
+    RedisModuleKey *mk = RedisModule_OpenKey(ctx, key, REDISMODULE_WRITE);
+    int killed = -1;
+    if (RedisModule_ModuleTypeGetType(mk) == moduleType) {
+        RedisModule_DeleteKey(mk); /* timer is freed by free callback */
+        killed = 1;
+    }
+    RedisModule_CloseKey(mk);
+    return killed;
+}
+
+/* Entrypoint for TIMER.NEW command.
+ * This command creates a new timer.
+ * Syntax: TIMER.NEW key function interval [NX | XX] [GT | LT] [GET] [DEBOUNCE] [PXAT unix-ms] [LOOP] [RATE [SKIP | BURST]] [TIMES n] [JITTER ms] [SLACK ms] [CMD | STREAM [MAXLEN [~|=] count] | POLL | BATCH] numkeys [key [key ...]] [arg [arg ...]]
+ * If LOOP is specified, after executing a new timer is created
+ * If SLACK is specified, the timer may fire up to `ms` late, to share a wake-up with others
+ * If CMD is specified, `function` is a redis command called with keys & args, instead of FCALL
+ * If STREAM is specified, `function` is a stream key, args are field value pairs appended to it, numkeys must be 0
+ * If POLL is specified, `function` is a queue, the fired timer waits in it to be taken by TIMER.POLL, numkeys must be 0
+ * If BATCH is specified, `function` is called once for all the BATCH timers of it fired in a tick, with
+ * the keys of all the timers, and args `count [numkeys numargs arg ...] ...`
+ * NX only creates a new timer, XX only replaces an existing timer, GT and LT only replace an existing timer
+ * if the new deadline is later or earlier, and create the timer if not exists
+ * DEBOUNCE only moves the deadline of an existing timer, which keeps its function, args and options
+ * Return 1 if new timer created, 0 if replace old timer, nil if not set by the conditions
+ * With GET, return the remaining time of the old timer instead, nil if not exists
+ */
+int TimerNewCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    TimerOptions opts;
+    long long numkeys;
+    const char *err;
+    int pos = 3;
+
+    if (argc < 5) {
+        return RedisModule_WrongArity(ctx);
+    }
+    if (parseTimerOptions(argv, argc, &pos, &opts, &numkeys, &err) != REDISMODULE_OK) {
+        return err ? RedisModule_ReplyWithError(ctx, err) : RedisModule_WrongArity(ctx);
+    }
+    int datalen = argc - pos;
+    if (datalen < numkeys) {
+        return RedisModule_WrongArity(ctx);
+    }
+    if (!validTimerData(&opts, datalen)) {
+        return RedisModule_ReplyWithError(ctx, "ERR STREAM needs field value pairs");
+    }
+    if (!validPollKey(ctx, &opts, argv[1], argv[2])) {
+        return RedisModule_ReplyWithError(ctx, "ERR POLL timer must be in the hash slot of its queue");
+    }
+    if ((err = checkTimerCommand(ctx, &opts, argv[2], argv+pos, datalen))) {
+        return RedisModule_ReplyWithError(ctx, err);
+    }
+    mstime_t expire = firstExpire(&opts);
+    mstime_t remaining = -1;    /* of the old timer, -1 if not exists */
+    TimerData *old = NULL;
+    bool skip = false;          /* a condition is not met, `expire` may be negative for an old PXAT */
+    if (opts.cond) {
+        RedisModuleKey *mk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ); /* auto closed */
+        if (RedisModule_ModuleTypeGetType(mk) == moduleType) {
+            old = RedisModule_ModuleTypeGetValue(mk);
+            remaining = old->expire - monotonicMs();
+            if (remaining < 0) remaining = 0;
+            if ((opts.cond & COND_NX) || (opts.cond & COND_GT && expire <= old->expire) ||
+                (opts.cond & COND_LT && expire >= old->expire)) {
+                skip = true;
+            }
+        } else if (opts.cond & COND_XX) {
+            skip = true;
+        }
+    }
+    int created = -1;
+    if (!skip && old && opts.cond & COND_DEBOUNCE) {
+        created = 0;
+        touchTimer(old, expire);
+        wheelArm(ctx);
+        replicateTouch(ctx, argv[1], expire);
+    } else if (!skip) {
+        created = newTimer(ctx, argv[1], argv[2], &opts, (int)numkeys, argv+pos, datalen, expire);
+        wheelArm(ctx);
+        replicateWithDeadline(ctx, argv, argc, 3, &opts);
+    }
+    if (opts.cond & COND_GET) {
+        return remaining < 0 ? RedisModule_ReplyWithNull(ctx) : RedisModule_ReplyWithLongLong(ctx, remaining);
+    }
+    return created < 0 ? RedisModule_ReplyWithNull(ctx) : RedisModule_ReplyWithLongLong(ctx, created);
+}
+
+/* Entrypoint for TIMER.MNEW command.
+ * This command creates timers in bulk, sharing function, interval and options.
+ * Syntax: TIMER.MNEW function interval [PXAT unix-ms] [LOOP] [RATE [SKIP | BURST]] [TIMES n] [JITTER ms] [SLACK ms] [CMD | STREAM [MAXLEN [~|=] count] | POLL | BATCH] numkeys numargs id [key ...] [arg ...] [id [key ...] [arg ...] ...]
+ * Every timer has exactly `numkeys` keys and `numargs` args
+ * Return an array, 1 if new timer created, 0 if replace old timer
+ */
+int TimerMNewCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    TimerOptions opts;
+    long long numkeys, numargs;
+    const char *err;
+    int pos = 2;
+
+    if (argc < 6) {
+        return RedisModule_IsKeysPositionRequest(ctx) ? REDISMODULE_OK : RedisModule_WrongArity(ctx);
+    }
+    if (parseTimerOptions(argv, argc, &pos, &opts, &numkeys, &err) != REDISMODULE_OK) {
+        if (RedisModule_IsKeysPositionRequest(ctx)) return REDISMODULE_OK;
+        return err ? RedisModule_ReplyWithError(ctx, err) : RedisModule_WrongArity(ctx);
+    }
+    if (pos >= argc || RedisModule_StringToLongLong(argv[pos], &numargs) != REDISMODULE_OK || numargs < 0) {
+        if (RedisModule_IsKeysPositionRequest(ctx)) return REDISMODULE_OK;
+        return pos >= argc ? RedisModule_WrongArity(ctx) : RedisModule_ReplyWithError(ctx, "ERR invalid numargs");
+    }
+    pos++;
+    long long stride = 1 + numkeys + numargs;
+    if (argc == pos || (argc - pos) % stride != 0) {
+        return RedisModule_IsKeysPositionRequest(ctx) ? REDISMODULE_OK : RedisModule_WrongArity(ctx);
+    }
+    if (RedisModule_IsKeysPositionRequest(ctx)) {
+        for (int i = pos; i < argc; i += (int)stride) {
+            RedisModule_KeyAtPos(ctx, i);
+        }
+        return REDISMODULE_OK;
+    }
+    if (opts.cond) {
+        return RedisModule_ReplyWithError(ctx, "ERR NX, XX, GT, LT, GET and DEBOUNCE are only supported by TIMER.NEW");
+    }
+    if (!validTimerData(&opts, numargs)) {
+        return RedisModule_ReplyWithError(ctx, "ERR STREAM needs field value pairs");
+    }
+    for (int i = pos; i < argc; i += (int)stride) {
+        if (!validPollKey(ctx, &opts, argv[i], argv[1])) {
+            return RedisModule_ReplyWithError(ctx, "ERR POLL timer must be in the hash slot of its queue");
+        }
+        if ((err = checkTimerCommand(ctx, &opts, argv[1], argv+i+1, (int)(stride-1)))) {
+            return RedisModule_ReplyWithError(ctx, err);
+        }
+    }
+    mstime_t expire = firstExpire(&opts);
+    RedisModule_ReplyWithArray(ctx, (argc - pos) / stride);
+    for (int i = pos; i < argc; i += (int)stride) {
+        int created = newTimer(ctx, argv[i], argv[1], &opts, (int)numkeys, argv+i+1, (int)(stride-1), expire);
+        RedisModule_ReplyWithLongLong(ctx, created);
+    }
+    wheelArm(ctx);
+    replicateWithDeadline(ctx, argv, argc, 2, &opts);
+    return REDISMODULE_OK;
+}
+
+
+/* Syntax: TIMER.KILL key
+*  Return 1 if a timer been kill, else 0
+*  More effective than DEL key, will clear all the resources
+*/
+int TimerKillCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc != 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+    int killed = killTimer(ctx, argv[1]);
+    if (killed < 0) {
+        return RedisModule_ReplyWithError(ctx, "ERR wrong type");
+    }
+    if (killed) {
+        RedisModule_ReplicateVerbatim(ctx);
+    }
+    return RedisModule_ReplyWithLongLong(ctx, killed);
+}
+
+/* Syntax: TIMER.MKILL key [key ...]
+*  Return an array, 1 if a timer been kill, 0 if not exists, error if not a timer
+*/
+int TimerMKillCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc < 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+    bool replicate = false;
+    RedisModule_ReplyWithArray(ctx, argc - 1);
+    for (int i = 1; i < argc; i++) {
+        int killed = killTimer(ctx, argv[i]);
+        if (killed < 0) {
+            RedisModule_ReplyWithError(ctx, "ERR wrong type");
+        } else {
+            RedisModule_ReplyWithLongLong(ctx, killed);
+            replicate |= killed;
+        }
+    }
+    if (replicate) {
+        RedisModule_ReplicateVerbatim(ctx);
+    }
+    return REDISMODULE_OK;
+}
+
+/* Syntax: TIMER.TOUCH key [milliseconds | PXAT unix-ms]
+*  Move the deadline of a timer to `milliseconds` from now, its interval by default, or to `unix-ms`,
+*  in place, the timer keeps its function, args and options. Cheaper than TIMER.NEW for heartbeats
+*  Return 1 if the timer been touched, 0 if not exists, error if not a timer
+*/
+int TimerTouchCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    long long ms = 0;
+    bool pxat = argc == 4 && strcasecmp(RedisModule_StringPtrLen(argv[2], NULL), "PXAT") == 0;
+    if (argc != 2 && argc != 3 && !pxat) {
+        return RedisModule_WrongArity(ctx);
+    }
+    if (argc > 2 && (RedisModule_StringToLongLong(argv[argc-1], &ms) != REDISMODULE_OK || ms <= 0)) {
+        return RedisModule_ReplyWithError(ctx, pxat ? "ERR invalid deadline" : "ERR invalid interval");
+    }
+    RedisModuleKey *mk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ); /* auto closed */
+    if (RedisModule_ModuleTypeGetType(mk) != moduleType) {
+        return mk ? RedisModule_ReplyWithError(ctx, "ERR wrong type") : RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+    TimerData *td = RedisModule_ModuleTypeGetValue(mk);
+    mstime_t now = monotonicMs();
+    mstime_t expire = pxat ? now + ms - RedisModule_Milliseconds() : now + (argc == 3 ? ms : td->interval);
+    touchTimer(td, expire);
+    wheelArm(ctx);
+    replicateTouch(ctx, argv[1], expire);
+    return RedisModule_ReplyWithLongLong(ctx, 1);
+}
+
+/* Entrypoint for TIMER.SADD command.
+ * This command adds a timer named `member` to the timer set of `key`, creating the set if not exists.
+ * Syntax: TIMER.SADD key member function interval [PXAT unix-ms] [LOOP] [RATE [SKIP | BURST]] [TIMES n] [JITTER ms] [SLACK ms] [CMD | STREAM [MAXLEN [~|=] count] | POLL | BATCH] numkeys [key [key ...]] [arg [arg ...]]
+ * Options are the same as TIMER.NEW, the timer is known as `member` where TIMER.NEW uses the key
+ * Fired one-time members are removed, the key is deleted with its last member, killing the key kills all the members
+ * Return 1 if new member added, 0 if replace old member
+ */
+int TimerSAddCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    TimerOptions opts;
+    long long numkeys;
+    const char *err;
+    int pos = 4;
+
+    if (argc < 6) {
+        return RedisModule_WrongArity(ctx);
+    }
+    if (parseTimerOptions(argv, argc, &pos, &opts, &numkeys, &err) != REDISMODULE_OK) {
+        return err ? RedisModule_ReplyWithError(ctx, err) : RedisModule_WrongArity(ctx);
+    }
+    if (opts.cond) {
+        return RedisModule_ReplyWithError(ctx, "ERR NX, XX, GT, LT, GET and DEBOUNCE are only supported by TIMER.NEW");
+    }
+    int datalen = argc - pos;
+    if (datalen < numkeys) {
+        return RedisModule_WrongArity(ctx);
+    }
+    if (!validTimerData(&opts, datalen)) {
+        return RedisModule_ReplyWithError(ctx, "ERR STREAM needs field value pairs");
+    }
+    if (!validPollKey(ctx, &opts, argv[1], argv[3])) {
+        return RedisModule_ReplyWithError(ctx, "ERR POLL timer must be in the hash slot of its queue");
+    }
+    if ((err = checkTimerCommand(ctx, &opts, argv[3], argv+pos, datalen))) {
+        return RedisModule_ReplyWithError(ctx, err);
+    }
+    int added = addSetMember(ctx, argv[1], argv[2], argv[3], &opts, (int)numkeys, argv+pos, datalen, firstExpire(&opts));
+    if (added < 0) {
+        return RedisModule_ReplyWithError(ctx, "ERR wrong type");
+    }
+    wheelArm(ctx);
+    replicateWithDeadline(ctx, argv, argc, 4, &opts);
+    return RedisModule_ReplyWithLongLong(ctx, added);
+}
+
+/* Entrypoint for TIMER.MSADD command.
+ * This command adds timers to the timer set of `key` in bulk, sharing function, interval and options.
+ * Syntax: TIMER.MSADD key function interval [PXAT unix-ms] [LOOP] [RATE [SKIP | BURST]] [TIMES n] [JITTER ms] [SLACK ms] [CMD | STREAM [MAXLEN [~|=] count] | POLL | BATCH] numkeys numargs member [key ...] [arg ...] [member [key ...] [arg ...] ...]
+ * Every member has exactly `numkeys` keys and `numargs` args
+ * Return an array, 1 if new member added, 0 if replace old member
+ */
+int TimerMSAddCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    TimerOptions opts;
+    long long numkeys, numargs;
+    const char *err;
+    int pos = 3;
+
+    if (argc < 7) {
+        return RedisModule_WrongArity(ctx);
+    }
+    if (parseTimerOptions(argv, argc, &pos, &opts, &numkeys, &err) != REDISMODULE_OK) {
+        return err ? RedisModule_ReplyWithError(ctx, err) : RedisModule_WrongArity(ctx);
+    }
+    if (opts.cond) {
+        return RedisModule_ReplyWithError(ctx, "ERR NX, XX, GT, LT, GET and DEBOUNCE are only supported by TIMER.NEW");
+    }
+    if (pos >= argc || RedisModule_StringToLongLong(argv[pos], &numargs) != REDISMODULE_OK || numargs < 0) {
+        return pos >= argc ? RedisModule_WrongArity(ctx) : RedisModule_ReplyWithError(ctx, "ERR invalid numargs");
+    }
+    pos++;
+    long long stride = 1 + numkeys + numargs;
+    if (argc == pos || (argc - pos) % stride != 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+    if (!validTimerData(&opts, numargs)) {
+        return RedisModule_ReplyWithError(ctx, "ERR STREAM needs field value pairs");
+    }
+    if (!validPollKey(ctx, &opts, argv[1], argv[2])) {
+        return RedisModule_ReplyWithError(ctx, "ERR POLL timer must be in the hash slot of its queue");
+    }
+    for (int i = pos; i < argc; i += (int)stride) {
+        if ((err = checkTimerCommand(ctx, &opts, argv[2], argv+i+1, (int)(stride-1)))) {
+            return RedisModule_ReplyWithError(ctx, err);
+        }
+    }
+    RedisModuleKey *mk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ); /* auto closed */
+    if (mk && RedisModule_ModuleTypeGetType(mk) != setType) {
+        return RedisModule_ReplyWithError(ctx, "ERR wrong type");
+    }
+    mstime_t expire = firstExpire(&opts);
+    RedisModule_ReplyWithArray(ctx, (argc - pos) / stride);
+    for (int i = pos; i < argc; i += (int)stride) {
+        int added = addSetMember(ctx, argv[1], argv[i], argv[2], &opts, (int)numkeys, argv+i+1, (int)(stride-1), expire);
+        RedisModule_ReplyWithLongLong(ctx, added);
+    }
+    wheelArm(ctx);
+    replicateWithDeadline(ctx, argv, argc, 3, &opts);
+    return REDISMODULE_OK;
+}
+
+/* Syntax: TIMER.SREM key member [member ...]
+*  Kill the members of timer set `key`, the key is deleted with its last member
+*  Return the number of members killed
+*/
+int TimerSRemCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc < 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+    RedisModuleKey *mk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ); /* auto closed */
+    if (RedisModule_ModuleTypeGetType(mk) != setType) {
+        return mk ? RedisModule_ReplyWithError(ctx, "ERR wrong type") : RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+    TimerSet *set = RedisModule_ModuleTypeGetValue(mk);
+    RedisModule_CloseKey(mk);
+    long long killed = 0;
+    for (int i = 2; i < argc; i++) {
+        size_t len;
+        const char *member = RedisModule_StringPtrLen(argv[i], &len);
+        bool last = RedisModule_DictSize(set->members) == 1;
+        if (removeSetMember(ctx, set, member, len)) {
+            killed++;
+            if (last) break; /* `set` is freed with the last member */
+        }
+    }
+    if (killed) {
+        RedisModule_ReplicateVerbatim(ctx);
+    }
+    return RedisModule_ReplyWithLongLong(ctx, killed);
+}
+
+/* Syntax: TIMER.SCARD key
+*  Return the number of members in timer set `key`, 0 if not exists
+*/
+int TimerSCardCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc != 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+    RedisModuleKey *mk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ); /* auto closed */
+    if (RedisModule_ModuleTypeGetType(mk) != setType) {
+        return mk ? RedisModule_ReplyWithError(ctx, "ERR wrong type") : RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+    TimerSet *set = RedisModule_ModuleTypeGetValue(mk);
+    return RedisModule_ReplyWithLongLong(ctx, (long long)RedisModule_DictSize(set->members));
+}
+
+int PollReplyCallback(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+    replyPollBatch(ctx, RedisModule_GetBlockedClientPrivateData(ctx));
+    return REDISMODULE_OK;
+}
+
+/* forget the waiter of a blocked client gone before being served, return false if already served */
+static bool abandonPollWaiter(RedisModuleBlockedClient *bc) {
+    PollWaiter *waiter = RedisModule_DictGetC(poller.waiters, &bc, sizeof(bc), NULL);
+    if (!waiter) return false;
+    PollQueue *queue = waiter->queue;
+    removePollWaiter(waiter);
+    tryFreePollQueue(queue);
+    RedisModule_UnblockClient(bc, NULL);
+    return true;
+}
+
+int PollTimeoutCallback(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+    abandonPollWaiter(RedisModule_GetBlockedClientHandle(ctx));
+    return RedisModule_ReplyWithNullArray(ctx);
+}
+
+void PollDisconnectCallback(RedisModuleCtx *ctx, RedisModuleBlockedClient *bc) {
+    REDISMODULE_NOT_USED(ctx);
+    abandonPollWaiter(bc);
+}
+
+void PollFreeCallback(RedisModuleCtx *ctx, void *privdata) {
+    REDISMODULE_NOT_USED(ctx);
+    if (privdata) freePollBatch(privdata);
+}
+
+/* Syntax: TIMER.POLL queue [COUNT count] [BLOCK milliseconds]
+*  Take fired poll timers of `queue` in the selected db, in deadline order, at most `count` (default 1).
+*  One-time timers are deleted, loop timers are scheduled again.
+*  If none and BLOCK is specified, block until some fired, 0 to block forever.
+*  Return an array of [id, [arg ...]], or null if none
+*/
+int TimerPollCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc < 2 || argc % 2 != 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+    long long count = 1, block = -1;
+    for (int i = 2; i < argc; i += 2) {
+        const char *opt = RedisModule_StringPtrLen(argv[i], NULL);
+        if (strcasecmp(opt, "COUNT") == 0) {
+            if (RedisModule_StringToLongLong(argv[i+1], &count) != REDISMODULE_OK || count <= 0) {
+                return RedisModule_ReplyWithError(ctx, "ERR invalid count");
+            }
+        } else if (strcasecmp(opt, "BLOCK") == 0) {
+            if (RedisModule_StringToLongLong(argv[i+1], &block) != REDISMODULE_OK || block < 0) {
+                return RedisModule_ReplyWithError(ctx, "ERR invalid timeout");
+            }
+        } else {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+    }
+    size_t len;
+    const char *name = RedisModule_StringPtrLen(argv[1], &len);
+    int dbid = RedisModule_GetSelectedDb(ctx);
+    PollQueue *queue = getPollQueue(dbid, name, len, false);
+    if (queue && queue->due.head) {
+        PollBatch *batch = takePollTimers(ctx, queue, count);
+        tryFreePollQueue(queue);
+        replyPollBatch(ctx, batch);
+        freePollBatch(batch);
+        wheelArm(ctx);
+        return REDISMODULE_OK;
+    }
+    int flags = RedisModule_GetContextFlags(ctx);
+    if (block < 0 || (flags & (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA | REDISMODULE_CTX_FLAGS_DENY_BLOCKING))) {
+        return RedisModule_ReplyWithNullArray(ctx);
+    }
+    queue = getPollQueue(dbid, name, len, true);
+    PollWaiter *waiter = RedisModule_Calloc(1, sizeof(*waiter));
+    waiter->bc = RedisModule_BlockClient(ctx, PollReplyCallback, PollTimeoutCallback, PollFreeCallback, block);
+    waiter->queue = queue;
+    waiter->count = count;
+    waiter->prev = queue->tail;
+    if (queue->tail) {
+        queue->tail->next = waiter;
+    } else {
+        queue->head = waiter;
+    }
+    queue->tail = waiter;
+    RedisModule_DictSetC(poller.waiters, &waiter->bc, sizeof(waiter->bc), waiter);
+    RedisModule_SetDisconnectCallback(waiter->bc, PollDisconnectCallback);
+    return REDISMODULE_OK;
+}
+
+/* Syntax: TIMER.INFO key [member]
+*  Return timer info, remaining is the next fire time interval
+*  `member` is required if `key` is a timer set, and given the info of that member
+*/
+int TimerInfoCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc != 2 && argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+    RedisModuleKey *mk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ); /* auto closed */
+    if (RedisModule_ModuleTypeGetType(mk) != (argc == 2 ? moduleType : setType)) {
+        if (mk) {
+            return RedisModule_ReplyWithError(ctx, "ERR wrong type");
+        } else {
+            return RedisModule_ReplyWithNull(ctx);
+        }
+    }
+    TimerData *td = RedisModule_ModuleTypeGetValue(mk);
+    if (argc == 3) {
+        TimerSet *set = RedisModule_ModuleTypeGetValue(mk);
+        size_t mlen;
+        const char *member = RedisModule_StringPtrLen(argv[2], &mlen);
+        td = RedisModule_DictGetC(set->members, (void *)member, mlen, NULL);
+        if (!td) {
+            return RedisModule_ReplyWithNull(ctx);
+        }
+    }
+    mstime_t remaining = td->expire - monotonicMs();
+    if (remaining < 0) remaining = 0;
+    const char *p = td->payload, *s;
+    size_t len;
+    p = payloadNext(p, &s, &len);   /* key */
+    static const char *actions[] = {"fcall", "command", "stream", "poll", "batch"};
+    static const char *rates[] = {"none", "skip", "burst"};
+    bool trim = td->ext & (1U << EXT_MAXLEN), slack = td->ext & (1U << EXT_SLACK), times = td->ext & (1U << EXT_TIMES);
+    bool jitter = td->ext & (1U << EXT_JITTER);
+    RedisModule_ReplyWithMap(ctx, 5+td->datalen+(trim ? 2 : 0)+(slack ? 1 : 0)+(td->rate ? 1 : 0)+(times ? 1 : 0)+(jitter ? 1 : 0));
+    RedisModule_ReplyWithCString(ctx, "action");
+    RedisModule_ReplyWithCString(ctx, actions[td->action]);
+    RedisModule_ReplyWithCString(ctx, "function");
+    p = payloadNext(p, &s, &len);
+    RedisModule_ReplyWithStringBuffer(ctx, s, len);
+    RedisModule_ReplyWithCString(ctx, "interval");
+    RedisModule_ReplyWithLongLong(ctx, td->interval);
+    RedisModule_ReplyWithCString(ctx, "remaining");
+    RedisModule_ReplyWithLongLong(ctx, remaining);
+    RedisModule_ReplyWithCString(ctx, "loop");
+    RedisModule_ReplyWithBool(ctx, td->loop);
+    if (td->rate) {
+        RedisModule_ReplyWithCString(ctx, "rate");
+        RedisModule_ReplyWithCString(ctx, rates[td->rate]);
+    }
+    if (times) {
+        RedisModule_ReplyWithCString(ctx, "times");
+        RedisModule_ReplyWithLongLong(ctx, extGet(td, EXT_TIMES));
+    }
+    if (slack) {
+        RedisModule_ReplyWithCString(ctx, "slack");
+        RedisModule_ReplyWithLongLong(ctx, extGet(td, EXT_SLACK));
+    }
+    if (jitter) {
+        RedisModule_ReplyWithCString(ctx, "jitter");
+        RedisModule_ReplyWithLongLong(ctx, extGet(td, EXT_JITTER));
+    }
+    if (trim) {
+        long long maxlen = extGet(td, EXT_MAXLEN);
+        RedisModule_ReplyWithCString(ctx, "maxlen");
+        RedisModule_ReplyWithLongLong(ctx, maxlen < 0 ? -maxlen : maxlen);
+        RedisModule_ReplyWithCString(ctx, "approx");
+        RedisModule_ReplyWithBool(ctx, maxlen < 0);
+    }
+    for (int i = 0; i < td->datalen; i++) {
+        const char *fmt = i < td->numkeys ? "key%d" : "arg%d";
+        int index = i<td->numkeys ? i : i-td->numkeys;
+        RedisModuleString *name = RedisModule_CreateStringPrintf(ctx, fmt, index+1);
+        RedisModule_ReplyWithString(ctx, name);
+        p = payloadNext(p, &s, &len);
+        RedisModule_ReplyWithStringBuffer(ctx, s, len);
+    }
+    return REDISMODULE_OK;
+}
+
+static void replyHistogram(RedisModuleCtx *ctx, const Histogram *h) {
+    RedisModule_ReplyWithMap(ctx, 5);
+    RedisModule_ReplyWithCString(ctx, "count");
+    RedisModule_ReplyWithLongLong(ctx, h->count);
+    RedisModule_ReplyWithCString(ctx, "p50");
+    RedisModule_ReplyWithLongLong(ctx, histPercentile(h, 50));
+    RedisModule_ReplyWithCString(ctx, "p99");
+    RedisModule_ReplyWithLongLong(ctx, histPercentile(h, 99));
+    RedisModule_ReplyWithCString(ctx, "p999");
+    RedisModule_ReplyWithLongLong(ctx, histPercentile(h, 99.9));
+    RedisModule_ReplyWithCString(ctx, "max");
+    RedisModule_ReplyWithLongLong(ctx, h->max);
+}
+
+/* Syntax: TIMER.STATS [RESET]
+*  Return percentiles of the fire lag and the action duration in microseconds, or reset them
+*/
+int TimerStatsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc > 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+    if (argc == 2) {
+        if (strcasecmp(RedisModule_StringPtrLen(argv[1], NULL), "RESET") != 0) {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+        memset(&fireLag, 0, sizeof(fireLag));
+        memset(&actionDuration, 0, sizeof(actionDuration));
+        memset(&wakeupFires, 0, sizeof(wakeupFires));
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+    RedisModule_ReplyWithMap(ctx, 3);
+    RedisModule_ReplyWithCString(ctx, "fire_lag");
+    replyHistogram(ctx, &fireLag);
+    RedisModule_ReplyWithCString(ctx, "action_duration");
+    replyHistogram(ctx, &actionDuration);
+    RedisModule_ReplyWithCString(ctx, "fires_per_wakeup");
+    replyHistogram(ctx, &wakeupFires);
+    return REDISMODULE_OK;
+}
+
+static ModuleConfig *findConfig(const char *name) {
+    for (ModuleConfig *config = configs; config->name; config++) {
+        if (strcasecmp(config->name, name) == 0) {
+            return config;
+        }
+    }
+    return NULL;
+}
+
+static int setConfig(const char *name, RedisModuleString *value, const char **err) {
+    ModuleConfig *config = findConfig(name);
+    long long v;
+    if (!config) {
+        *err = "ERR unknown config";
+        return REDISMODULE_ERR;
+    }
+    if (config->enums) {
+        const char *s = RedisModule_StringPtrLen(value, NULL);
+        for (v = config->max; v >= config->min; v--) {
+            if (strcasecmp(config->enums[v], s) == 0) break;
+        }
+    } else if (RedisModule_StringToLongLong(value, &v) != REDISMODULE_OK) {
+        v = config->min - 1;
+    }
+    if (v < config->min || v > config->max) {
+        *err = "ERR invalid config value";
+        return REDISMODULE_ERR;
+    }
+    *config->value = v;
+    return REDISMODULE_OK;
+}
+
+/* Syntax: TIMER.CONFIG GET name|*
+*          TIMER.CONFIG SET name value
+*  Configs are local to the node, not replicated
+*/
+int TimerConfigCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc < 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+    const char *sub = RedisModule_StringPtrLen(argv[1], NULL);
+    const char *name = RedisModule_StringPtrLen(argv[2], NULL);
+    if (strcasecmp(sub, "GET") == 0 && argc == 3) {
+        bool all = strcmp(name, "*") == 0;
+        long len = 0;
+        RedisModule_ReplyWithMap(ctx, REDISMODULE_POSTPONED_LEN);
+        for (ModuleConfig *config = configs; config->name; config++) {
+            if (all || strcasecmp(config->name, name) == 0) {
+                RedisModule_ReplyWithCString(ctx, config->name);
+                if (config->enums) {
+                    RedisModule_ReplyWithCString(ctx, config->enums[*config->value]);
+                } else {
+                    RedisModule_ReplyWithLongLong(ctx, *config->value);
+                }
+                len++;
+            }
+        }
+        RedisModule_ReplySetMapLength(ctx, len);
+        return REDISMODULE_OK;
+    } else if (strcasecmp(sub, "SET") == 0 && argc == 4) {
+        const char *err;
+        if (setConfig(name, argv[3], &err) != REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(ctx, err);
+        }
+        applyReplicaMode(ctx);
+        wheelArm(ctx); /* deferred timers may fire sooner */
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+    return RedisModule_ReplyWithError(ctx, "ERR unknown subcommand or wrong number of arguments");
+}
+
+static void replyRateLimit(RedisModuleCtx *ctx, const RateLimit *limit) {
+    RedisModule_ReplyWithMap(ctx, 5);
+    RedisModule_ReplyWithCString(ctx, "rate");
+    RedisModule_ReplyWithLongLong(ctx, limit->rate);
+    RedisModule_ReplyWithCString(ctx, "burst");
+    RedisModule_ReplyWithLongLong(ctx, limit->burst);
+    RedisModule_ReplyWithCString(ctx, "backlog");
+    RedisModule_ReplyWithLongLong(ctx, limit->backlog.len);
+    RedisModule_ReplyWithCString(ctx, "deferred");
+    RedisModule_ReplyWithLongLong(ctx, limit->deferred);
+    RedisModule_ReplyWithCString(ctx, "max_deferral");
+    RedisModule_ReplyWithLongLong(ctx, limit->maxDeferral);
+}
+
+/* Syntax: TIMER.LIMIT SET function rate [burst]
+*          TIMER.LIMIT DEL function
+*          TIMER.LIMIT GET function|*
+*  Limit how many timers of a function fire per second, the timers over the limit are deferred in deadline
+*  order until the bucket of `burst` tokens refills. Limits are local to the node, not replicated
+*/
+int TimerLimitCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc < 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+    const char *sub = RedisModule_StringPtrLen(argv[1], NULL);
+    size_t len;
+    const char *name = RedisModule_StringPtrLen(argv[2], &len);
+    RateLimit *limit = RedisModule_DictGetC(limits.functions, (void *)name, len, NULL);
+    if (strcasecmp(sub, "GET") == 0 && argc == 3) {
+        if (strcmp(name, "*") != 0) {
+            if (!limit) return RedisModule_ReplyWithNull(ctx);
+            replyRateLimit(ctx, limit);
+            return REDISMODULE_OK;
+        }
+        RedisModule_ReplyWithMap(ctx, (long)RedisModule_DictSize(limits.functions));
+        RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(limits.functions, "^", NULL, 0);
+        void *function;
+        while ((function = RedisModule_DictNextC(iter, &len, (void **)&limit)) != NULL) {
+            RedisModule_ReplyWithStringBuffer(ctx, function, len);
+            replyRateLimit(ctx, limit);
+        }
+        RedisModule_DictIteratorStop(iter);
+        return REDISMODULE_OK;
+    } else if (strcasecmp(sub, "SET") == 0 && (argc == 4 || argc == 5)) {
+        long long rate, burst;
+        if (RedisModule_StringToLongLong(argv[3], &rate) != REDISMODULE_OK || rate <= 0) {
+            return RedisModule_ReplyWithError(ctx, "ERR invalid rate");
+        }
+        burst = rate;
+        if (argc == 5 && (RedisModule_StringToLongLong(argv[4], &burst) != REDISMODULE_OK || burst <= 0)) {
+            return RedisModule_ReplyWithError(ctx, "ERR invalid burst");
+        }
+        if (!limit) {
+            limit = RedisModule_Calloc(1, sizeof(*limit));
+            limit->tokens = burst;
+            limit->refillUs = monotonicUs();
+            RedisModule_DictSetC(limits.functions, (void *)name, len, limit);
+        }
+        limit->rate = rate;
+        limit->burst = burst;
+        wheelArm(ctx);
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    } else if (strcasecmp(sub, "DEL") == 0 && argc == 3) {
+        if (!limit) return RedisModule_ReplyWithLongLong(ctx, 0);
+        /* deferred timers are expired, they go back to the ready lists */
+        while (limit->backlog.head) {
+            TimerData *td = limit->backlog.head;
+            listRemove(td);
+            wheelInsert(td);
+        }
+        RedisModule_DictDelC(limits.functions, (void *)name, len, NULL);
+        RedisModule_Free(limit);
+        wheelArm(ctx);
+        return RedisModule_ReplyWithLongLong(ctx, 1);
+    }
+    return RedisModule_ReplyWithError(ctx, "ERR unknown subcommand or wrong number of arguments");
+}
+
+static void replyBreaker(RedisModuleCtx *ctx, const Breaker *breaker) {
+    mstime_t now = monotonicMs();
+    RedisModule_ReplyWithMap(ctx, 8);
+    RedisModule_ReplyWithCString(ctx, "state");
+    RedisModule_ReplyWithCString(ctx, breakerStates[breaker->state]);
+    RedisModule_ReplyWithCString(ctx, "cooldown");
+    RedisModule_ReplyWithLongLong(ctx, breaker->state == BREAKER_OPEN && breaker->until > now ? breaker->until - now : 0);
+    RedisModule_ReplyWithCString(ctx, "executions");
+    RedisModule_ReplyWithLongLong(ctx, breaker->executions);
+    RedisModule_ReplyWithCString(ctx, "errors");
+    RedisModule_ReplyWithLongLong(ctx, breaker->failures);
+    RedisModule_ReplyWithCString(ctx, "max_duration");
+    RedisModule_ReplyWithLongLong(ctx, breaker->maxUs);
+    RedisModule_ReplyWithCString(ctx, "trips");
+    RedisModule_ReplyWithLongLong(ctx, breaker->trips);
+    RedisModule_ReplyWithCString(ctx, "backlog");
+    RedisModule_ReplyWithLongLong(ctx, breaker->backlog.len);
+    RedisModule_ReplyWithCString(ctx, "dropped");
+    RedisModule_ReplyWithLongLong(ctx, breaker->dropped);
+}
+
+/* close the breaker of `name`, its deferred fires go ahead, and forget its executions */
+static void resetBreaker(const char *name, size_t len, Breaker *breaker) {
+    closeBreaker(breaker);
+    RedisModule_DictDelC(breakers, (void *)name, len, NULL);
+    RedisModule_Free(breaker);
+}
+
+/* Syntax: TIMER.BREAKER GET function|*
+*          TIMER.BREAKER RESET function|*
+*  Show the circuit breakers of the functions, or close them and forget their executions.
+*  Breakers are local to the node, not replicated
+*/
+int TimerBreakerCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+    const char *sub = RedisModule_StringPtrLen(argv[1], NULL);
+    size_t len;
+    const char *name = RedisModule_StringPtrLen(argv[2], &len);
+    bool all = strcmp(name, "*") == 0;
+    Breaker *breaker = all ? NULL : RedisModule_DictGetC(breakers, (void *)name, len, NULL);
+    if (strcasecmp(sub, "GET") == 0) {
+        if (!all) {
+            if (!breaker) return RedisModule_ReplyWithNull(ctx);
+            replyBreaker(ctx, breaker);
+            return REDISMODULE_OK;
+        }
+        RedisModule_ReplyWithMap(ctx, (long)RedisModule_DictSize(breakers));
+        RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(breakers, "^", NULL, 0);
+        void *function;
+        while ((function = RedisModule_DictNextC(iter, &len, (void **)&breaker)) != NULL) {
+            RedisModule_ReplyWithStringBuffer(ctx, function, len);
+            replyBreaker(ctx, breaker);
+        }
+        RedisModule_DictIteratorStop(iter);
+        return REDISMODULE_OK;
+    } else if (strcasecmp(sub, "RESET") == 0) {
+        long long n = 0;
+        if (!all) {
+            if (breaker) {
+                resetBreaker(name, len, breaker);
+                n++;
+            }
+        } else {
+            void *function;
+            RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(breakers, "^", NULL, 0);
+            while ((function = RedisModule_DictNextC(iter, &len, (void **)&breaker)) != NULL) {
+                closeBreaker(breaker);
+                RedisModule_Free(breaker);
+                n++;
+            }
+            RedisModule_DictIteratorStop(iter);
+            RedisModule_FreeDict(NULL, breakers);
+            breakers = RedisModule_CreateDict(NULL);
+        }
+        wheelArm(ctx);
+        return RedisModule_ReplyWithLongLong(ctx, n);
+    }
+    return RedisModule_ReplyWithError(ctx, "ERR unknown subcommand or wrong number of arguments");
+}
+
+/* sample the fires every FIRE_SAMPLE_PERIOD milliseconds, like instantaneous_ops_per_sec of redis */
+void cronLoopCallback(RedisModuleCtx *ctx, RedisModuleEvent e, uint64_t sub, void *data) {
+    REDISMODULE_NOT_USED(ctx);
+    REDISMODULE_NOT_USED(e);
+    REDISMODULE_NOT_USED(sub);
+    REDISMODULE_NOT_USED(data);
+    internSweep();
+    mstime_t now = monotonicMs();
+    mstime_t elapsed = now - stats.sampleTime;
+    if (elapsed < FIRE_SAMPLE_PERIOD) return;
+    stats.samples[stats.sampleIdx] = (stats.fired - stats.sampleFired) * 1000 / elapsed;
+    stats.sampleIdx = (stats.sampleIdx + 1) % FIRE_SAMPLES;
+    stats.sampleTime = now;
+    stats.sampleFired = stats.fired;
+}
+
+void InfoCallback(RedisModuleInfoCtx *ctx, int for_crash_report) {
+    REDISMODULE_NOT_USED(for_crash_report);
+    long long loops = 0, live = 0, firesPerSec = 0;
+    for (int i = 0; i < dispatcher.dbnum; i++) {
+        live += stats.dbs[i].timers;
+        loops += stats.dbs[i].loops;
+    }
+    for (int i = 0; i < FIRE_SAMPLES; i++) {
+        firesPerSec += stats.samples[i];
+    }
+    RedisModule_InfoAddSection(ctx, "stats");
+    RedisModule_InfoAddFieldLongLong(ctx, "timers", __atomic_load_n(&timers, __ATOMIC_RELAXED));
+    RedisModule_InfoAddFieldLongLong(ctx, "zombies", __atomic_load_n(&zombies, __ATOMIC_RELAXED));
+    RedisModule_InfoAddFieldLongLong(ctx, "loop_timers", loops);
+    RedisModule_InfoAddFieldLongLong(ctx, "oneshot_timers", live - loops);
+    RedisModule_InfoAddFieldLongLong(ctx, "payload_bytes", __atomic_load_n(&stats.payloadBytes, __ATOMIC_RELAXED));
+    RedisModule_InfoAddFieldLongLong(ctx, "fired", stats.fired);
+    RedisModule_InfoAddFieldLongLong(ctx, "fires_per_sec", firesPerSec / FIRE_SAMPLES);
+    RedisModule_InfoAddFieldLongLong(ctx, "action_errors", stats.actionErrors);
+    RedisModule_InfoAddFieldLongLong(ctx, "wakeups", stats.wakeups);
+    RedisModule_InfoAddFieldLongLong(ctx, "slack_wakeups_saved", stats.wakeupsSaved);
+    RedisModule_InfoAddFieldLongLong(ctx, "dispatch_backlog", dispatchBacklog());
+    RedisModule_InfoAddFieldLongLong(ctx, "passive_timers", passive.timers.len);
+    RedisModule_InfoAddFieldLongLong(ctx, "caught_up", stats.caughtUp);
+    RedisModule_InfoAddFieldLongLong(ctx, "caught_up_skipped", stats.skipped);
+    RedisModule_InfoAddFieldLongLong(ctx, "periods_skipped", stats.periodsSkipped);
+    RedisModule_InfoAddFieldLongLong(ctx, "jittered", stats.jittered);
+    mstime_t maxDeferral;
+    RedisModule_InfoAddFieldLongLong(ctx, "rate_limited", stats.rateLimited);
+    RedisModule_InfoAddFieldLongLong(ctx, "rate_limited_backlog", deferredBacklog(&maxDeferral));
+    RedisModule_InfoAddFieldLongLong(ctx, "rate_limited_max_deferral_ms", maxDeferral);
+    long long open = 0, breakerBacklog = 0;
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(breakers, "^", NULL, 0);
+    Breaker *breaker;
+    while (RedisModule_DictNextC(iter, NULL, (void **)&breaker)) {
+        open += breaker->state != BREAKER_CLOSED;
+        breakerBacklog += breaker->backlog.len;
+    }
+    RedisModule_DictIteratorStop(iter);
+    RedisModule_InfoAddFieldLongLong(ctx, "breakers_open", open);
+    RedisModule_InfoAddFieldLongLong(ctx, "breaker_backlog", breakerBacklog);
+    RedisModule_InfoAddFieldLongLong(ctx, "breaker_deferred", stats.breakerDeferred);
+    RedisModule_InfoAddFieldLongLong(ctx, "breaker_dropped", stats.breakerDropped);
+    long long refs = __atomic_load_n(&intern.refs, __ATOMIC_RELAXED);
+    long long refBytes = __atomic_load_n(&intern.refBytes, __ATOMIC_RELAXED);
+    RedisModule_InfoAddFieldLongLong(ctx, "intern_strings", (long long)RedisModule_DictSize(intern.strings));
+    RedisModule_InfoAddFieldLongLong(ctx, "intern_refs", refs);
+    RedisModule_InfoAddFieldLongLong(ctx, "intern_hits", intern.hits);
+    RedisModule_InfoAddFieldLongLong(ctx, "intern_misses", intern.misses);
+    RedisModule_InfoAddFieldDouble(ctx, "intern_hit_rate",
+                                   intern.hits ? (double)intern.hits / (intern.hits + intern.misses) : 0);
+    RedisModule_InfoAddFieldLongLong(ctx, "intern_bytes_saved", refBytes - refs * (long long)sizeof(void*) - intern.bytes);
+
+    RedisModule_InfoAddSection(ctx, "keyspace");
+    for (int i = 0; i < dispatcher.dbnum; i++) {
+        DbStats *dbs = &stats.dbs[i];
+        long long dbZombies = __atomic_load_n(&dbs->zombies, __ATOMIC_RELAXED);
+        if (!dbs->timers && !dbZombies) continue;
+        char name[16];
+        snprintf(name, sizeof(name), "db%d", i);
+        RedisModule_InfoBeginDictField(ctx, name);
+        RedisModule_InfoAddFieldLongLong(ctx, "timers", dbs->timers);
+        RedisModule_InfoAddFieldLongLong(ctx, "zombies", dbZombies);
+        RedisModule_InfoAddFieldLongLong(ctx, "backlog", dispatcher.ready[i].len);
+        RedisModule_InfoEndDictField(ctx);
+    }
+}
+
+/* max number of arguments returned by timerOptionsArgv */
+#define TIMER_OPTIONS_ARGC 18
+/* max members per TIMER.MSADD emitted by AOF rewrite, as redis does for its own types */
+#define AOF_REWRITE_ITEMS_PER_CMD 64
+
+/* options of TIMER.NEW in command arguments form, starting with the deadline as PXAT, return the number of arguments */
+static int timerOptionsArgv(RedisModuleCtx *ctx, const TimerData *td, RedisModuleString **argv) {
+    int argc = 0;
+    argv[argc++] = RedisModule_CreateString(ctx, "PXAT", 4);
+    argv[argc++] = RedisModule_CreateStringFromLongLong(ctx, RedisModule_Milliseconds() + td->expire - monotonicMs());
+    if (td->loop) {
+        argv[argc++] = RedisModule_CreateString(ctx, "LOOP", 4);
+    }
+    if (td->rate != RATE_NONE) {
+        argv[argc++] = RedisModule_CreateString(ctx, "RATE", 4);
+        argv[argc++] = RedisModule_CreateString(ctx, td->rate == RATE_SKIP ? "SKIP" : "BURST", td->rate == RATE_SKIP ? 4 : 5);
+    }
+    if (td->ext & (1U << EXT_TIMES)) {
+        argv[argc++] = RedisModule_CreateString(ctx, "TIMES", 5);
+        argv[argc++] = RedisModule_CreateStringFromLongLong(ctx, extGet(td, EXT_TIMES));
+    }
+    if (td->ext & (1U << EXT_JITTER)) {
+        argv[argc++] = RedisModule_CreateString(ctx, "JITTER", 6);
+        argv[argc++] = RedisModule_CreateStringFromLongLong(ctx, extGet(td, EXT_JITTER));
+    }
+    if (td->ext & (1U << EXT_SLACK)) {
+        argv[argc++] = RedisModule_CreateString(ctx, "SLACK", 5);
+        argv[argc++] = RedisModule_CreateStringFromLongLong(ctx, extGet(td, EXT_SLACK));
+    }
+    if (td->action == ACTION_COMMAND) {
+        argv[argc++] = RedisModule_CreateString(ctx, "CMD", 3);
+    } else if (td->action == ACTION_STREAM) {
+        argv[argc++] = RedisModule_CreateString(ctx, "STREAM", 6);
+    } else if (td->action == ACTION_POLL) {
+        argv[argc++] = RedisModule_CreateString(ctx, "POLL", 4);
+    } else if (td->action == ACTION_BATCH) {
+        argv[argc++] = RedisModule_CreateString(ctx, "BATCH", 5);
+    }
+    if (td->ext & (1U << EXT_MAXLEN)) {
+        long long maxlen = extGet(td, EXT_MAXLEN);
+        argv[argc++] = RedisModule_CreateString(ctx, "MAXLEN", 6);
+        argv[argc++] = RedisModule_CreateString(ctx, maxlen < 0 ? "~" : "=", 1);
+        argv[argc++] = RedisModule_CreateStringFromLongLong(ctx, maxlen < 0 ? -maxlen : maxlen);
+    }
+    return argc;
+}
+
+/* Set the deadline of a loaded timer from `deadline` in unix milliseconds, if it passed while the server
+ * was down, catch up by the `catch-up` policy. POLL timers are never skipped, they may be fired but not
+ * taken yet. A replica keeps the deadline, master still owns the timer and replicates its deletion.
+ * Return false if the timer is skipped */
+static bool catchUpLoaded(TimerData *td, mstime_t deadline, mstime_t now, mstime_t wallclock) {
+    mstime_t remaining = deadline - wallclock;
+    if (remaining > 0 || !isMaster || loading.replica) {
+        td->expire = now + remaining;
+        return true;
+    }
+    stats.caughtUp++;
+    if (catchUp == CATCH_UP_SPREAD && catchUpWindow > 0) {
+        size_t len;
+        const char *key = payloadAt(td, PAYLOAD_KEY, &len);
+        td->expire = now + (mstime_t)(internHash(key, len) % (uint64_t)catchUpWindow);
+    } else if (td->action == ACTION_POLL) {
+        td->expire = now;
+    } else if (td->loop) {
+        /* the next fire in phase, overdue loops firing together right after loading would be a burst */
+        if (catchUp == CATCH_UP_SKIP) stats.skipped++;
+        mstime_t late = -remaining % td->interval;
+        td->expire = late ? now + td->interval - late : now;
+    } else if (catchUp == CATCH_UP_SKIP) {
+        stats.skipped++;
+        return false;
+    } else {
+        td->expire = now;
+    }
+    return true;
+}
+
+static void saveTimerOptions(RedisModuleIO *io, const TimerData *td) {
+    int64_t opts[12];
+    int n = 0;
+    if (td->action != ACTION_FCALL) {
+        opts[n++] = RDB_OPT_ACTION;
+        opts[n++] = td->action;
+    }
+    if (td->ext & (1U << EXT_MAXLEN)) {
+        opts[n++] = RDB_OPT_MAXLEN;
+        opts[n++] = extGet(td, EXT_MAXLEN);
+    }
+    if (td->ext & (1U << EXT_SLACK)) {
+        opts[n++] = RDB_OPT_SLACK;
+        opts[n++] = extGet(td, EXT_SLACK);
+    }
+    if (td->rate != RATE_NONE) {
+        opts[n++] = RDB_OPT_RATE;
+        opts[n++] = td->rate;
+    }
+    if (td->ext & (1U << EXT_TIMES)) {
+        opts[n++] = RDB_OPT_TIMES;
+        opts[n++] = extGet(td, EXT_TIMES);
+    }
+    if (td->ext & (1U << EXT_JITTER)) {
+        opts[n++] = RDB_OPT_JITTER;
+        opts[n++] = extGet(td, EXT_JITTER);
+    }
+    RedisModule_SaveUnsigned(io, n/2);
+    for (int i = 0; i < n; i++) {
+        RedisModule_SaveSigned(io, opts[i]);
+    }
 }
 
-/* release all the memory used in timer structure */
-void DeleteTimerData(RedisModuleCtx *ctx, TimerData *td) {
-    RedisModule_FreeString(ctx, td->key);
-    RedisModule_FreeString(ctx, td->function);
-    for (int i = 0; i < td->datalen; i++) {
-        RedisModule_FreeString(ctx, td->data[i]);
+static int loadTimerOptions(RedisModuleIO *io, TimerOptions *opts) {
+    uint64_t n = RedisModule_LoadUnsigned(io);
+    for (uint64_t i = 0; i < n; i++) {
+        int64_t tag = RedisModule_LoadSigned(io);
+        int64_t value = RedisModule_LoadSigned(io);
+        switch (tag) {
+        case RDB_OPT_ACTION:
+            if (value < ACTION_FCALL || value > ACTION_BATCH) {
+                RedisModule_LogIOError(io, "warning", "decode failed, unknown action: %lld", (long long)value);
+                return REDISMODULE_ERR;
+            }
+            opts->action = (TimerAction)value;
+            break;
+        case RDB_OPT_MAXLEN:
+            setTimerOption(opts, EXT_MAXLEN, value);
+            break;
+        case RDB_OPT_SLACK:
+            setTimerOption(opts, EXT_SLACK, value);
+            break;
+        case RDB_OPT_RATE:
+            if (value < RATE_NONE || value > RATE_BURST) {
+                RedisModule_LogIOError(io, "warning", "decode failed, unknown rate: %lld", (long long)value);
+                return REDISMODULE_ERR;
+            }
+            opts->rate = (TimerRate)value;
+            break;
+        case RDB_OPT_TIMES:
+            setTimerOption(opts, EXT_TIMES, value);
+            break;
+        case RDB_OPT_JITTER:
+            setTimerOption(opts, EXT_JITTER, value);
+            break;
+        default:
+            RedisModule_LogIOError(io, "warning", "decode failed, unknown option: %lld", (long long)tag);
+            return REDISMODULE_ERR;
+        }
     }
-    RedisModule_Free(td);
-    timers--;
+    return REDISMODULE_OK;
 }
 
-/* callback called by the Timer API. Data contains a TimerData structure */
-void TimerCallback(RedisModuleCtx *ctx, void *data) {
-    RedisModule_AutoMemory(ctx);
-    TimerData *td = (TimerData*)data;
-    bool delete_td = false;
+/* loaded timers are kept aside until loading ends, else scheduled as loaded, like by RESTORE */
+static bool loadingOnePass(void) {
+    return loading.active && loadScheduling == LOAD_ONE_PASS;
+}
 
-    if (td->dbid != -1) {
-        RedisModule_SelectDb(ctx, td->dbid);
+/* load a timer saved in `encver` and schedule it, it's a member of `owner` if not NULL */
+static TimerData *loadTimer(RedisModuleIO *io, int encver, TimerSet *owner) {
+    int datalen = (int)RedisModule_LoadSigned(io);
+    /* saved as data, key, function, packed as key, function, data */
+    char *stackStrs[PACK_STACK], **strs = stackStrs;
+    size_t stackLens[PACK_STACK] = {0}, *lens = stackLens;
+    if (datalen+2 > PACK_STACK) {
+        strs = RedisModule_Alloc(sizeof(char*)*(datalen+2));
+        lens = RedisModule_Alloc(sizeof(size_t)*(datalen+2));
     }
-    RedisModule_KeyExists(ctx, td->key);  // actively expire key
-    if (td->deleted) { /* already deleted from db, clear it */
-        DeleteTimerData(ctx, td);
-        return;
+    for (int i = 0; i < datalen+2; i++) {
+        int index = i < datalen ? PAYLOAD_DATA+i : i-datalen;
+        strs[index] = RedisModule_LoadStringBuffer(io, &lens[index]);
     }
-    /* if loop, create a new timer and reinsert
-     * if not, delete the timer data
-     */
-    if (td->loop) {
-        td->tid = RedisModule_CreateTimer(ctx, td->interval, TimerCallback, td);
-        td->dbid = -1; /* no need to select db again next time */
-    } else {
-        // replica also delete timer data, there is a race condition between replica timer firing
-        // and receiving master's 'timer.kill' action
-        RedisModuleKey *mk = RedisModule_OpenKey(ctx, td->key, REDISMODULE_WRITE);
-        RedisModule_DeleteKey(mk);
-        RedisModule_Replicate(ctx, "timer.kill", "s", td->key);
-        RedisModule_Assert(td->deleted);
-        // will delete `td` after function execution
-        delete_td = true;
+    TimerOptions opts = {.action = ACTION_FCALL};
+    int numkeys = (int)RedisModule_LoadSigned(io);
+    opts.interval = RedisModule_LoadSigned(io);
+    opts.loop = RedisModule_LoadSigned(io) == 1;
+    mstime_t deadline = encver >= 3 ? RedisModule_LoadSigned(io) : 0;
+    TimerData *td = NULL;
+    if (encver < 2 || loadTimerOptions(io, &opts) == REDISMODULE_OK) {
+        if (owner) {
+            setTimerOption(&opts, EXT_OWNER, (int64_t)(intptr_t)owner);
+        }
+        addJitterHash(&opts);
+        td = packTimerData((const char **)strs, lens, datalen+2, extSize(opts.ext));
+        applyTimerOptions(td, &opts);
+        td->datalen = datalen;
+        td->numkeys = numkeys;
     }
-    // execution at last to avoid function making `td` invalid (e.g. timer.kill `key` in function)
-    // also make interval more reliable for loop timer with slow function
-    if (isMaster) {
-        // if master, execute the script, replica will copy master's actions
-        RedisModule_Call(ctx, "FCALL", "!slv", td->function, (long long)td->numkeys, td->data, (size_t)td->datalen);
+    for (int i = 0; i < datalen+2; i++) {
+        RedisModule_Free(strs[i]);
+    }
+    if (strs != stackStrs) {
+        RedisModule_Free(strs);
+        RedisModule_Free(lens);
+    }
+    if (!td) {
+        return NULL;
+    }
+    /* see https://github.com/redis/redis/pull/11361 */
+    td->dbid = RedisModule_GetDbIdFromIO(io);
+    countTimer(td, 1);
+    mstime_t now = loading.active ? loading.monotonic : monotonicMs();
+    if (encver < 3) {
+        td->expire = now + td->interval;
+    } else if (!catchUpLoaded(td, deadline, now, loading.active ? loading.wallclock : RedisModule_Milliseconds())) {
+        listAppend(&loading.skipped, td);   /* its key can't be deleted while loading */
+        if (!loading.active && !loading.restored) {
+            /* RESTORE adds the key after loading it, delete it from the next event loop */
+            loading.restored = true;
+            RedisModule_CreateTimer(RedisModule_GetContextFromIO(io), 0, RestoredCallback, NULL);
+        }
+        return td;
     }
-    if (delete_td) {
-        // key was removed from db, so function has no way to invalidate `td`
-        DeleteTimerData(ctx, td);
+    if (loadingOnePass()) {
+        listAppend(&loading.pending, td);
+    } else {
+        wheelInsert(td);
     }
+    return td;
 }
 
+void *timer_RDBLoadCallBack(RedisModuleIO *io, int encver) {
+    if (encver < 1 || encver > ENCODE_VERSION) {
+        RedisModule_LogIOError(io, "warning", "decode failed, rdb ver: %d, my ver: %d", encver, ENCODE_VERSION);
+        return NULL;
+    }
+    TimerData *td = loadTimer(io, encver, NULL);
+    if (td && !loadingOnePass()) {
+        wheelArm(RedisModule_GetContextFromIO(io));
+    }
+    return td;
+}
 
-int keyEventsCallback(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *key) {
-    RedisModule_AutoMemory(ctx);
-    REDISMODULE_NOT_USED(type);
-    if (strcasecmp(event, "rename_to") == 0) {
-        RedisModuleKey *mk = RedisModule_OpenKey(ctx, key, REDISMODULE_READ);
-        if (RedisModule_ModuleTypeGetType(mk) == moduleType) {
-            TimerData *td = RedisModule_ModuleTypeGetValue(mk);
-            RedisModule_FreeString(ctx, td->key);
-            RedisModule_RetainString(ctx, key);
-            td->key = key;
-        }
-    } else if (strcasecmp(event, "move_to") == 0) {
-        RedisModuleKey *mk = RedisModule_OpenKey(ctx, key, REDISMODULE_READ);
-        if (RedisModule_ModuleTypeGetType(mk) == moduleType) {
-            TimerData *td = RedisModule_ModuleTypeGetValue(mk);
-            uint64_t remaining = td->interval;
-            RedisModule_GetTimerInfo(ctx, td->tid, &remaining, NULL);
-            RedisModule_StopTimer(ctx, td->tid, NULL);
-            td->tid = RedisModule_CreateTimer(ctx, remaining, TimerCallback, td);
-            td->dbid = -1;
-        }
+static void saveTimer(RedisModuleIO *io, const TimerData *td) {
+    const char *key, *function, *s;
+    size_t klen, flen, len;
+    const char *p = payloadNext(td->payload, &key, &klen);
+    p = payloadNext(p, &function, &flen);
+    RedisModule_SaveSigned(io, td->datalen);
+    for (int i = 0; i < td->datalen; i++) {
+        p = payloadNext(p, &s, &len);
+        RedisModule_SaveStringBuffer(io, s, len);
     }
-    return REDISMODULE_OK;
+    RedisModule_SaveStringBuffer(io, key, klen);
+    RedisModule_SaveStringBuffer(io, function, flen);
+    RedisModule_SaveSigned(io, td->numkeys);
+    RedisModule_SaveSigned(io, td->interval);
+    RedisModule_SaveSigned(io, td->loop ? 1 : 0);
+    RedisModule_SaveSigned(io, RedisModule_Milliseconds() + td->expire - monotonicMs());
+    saveTimerOptions(io, td);
 }
 
-/* Entrypoint for TIMER.NEW command.
- * This command creates a new timer.
- * Syntax: TIMER.NEW key function interval [LOOP] numkeys [key [key ...]] [arg [arg ...]]
- * If LOOP is specified, after executing a new timer is created
- * Return 1 if new timer created, 0 if replace old timer
- */
-int TimerNewCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-    long long interval;
-    long long numkeys;
-    bool loop = false;
-    int pos;
-    int datalen;
-    TimerData *td = NULL;
-    TimerData *old = NULL;
-    const char *s;
-    RedisModuleString *key, *function;
+void timer_RDBSaveCallBack(RedisModuleIO *io, void *value) {
+    saveTimer(io, value);
+}
 
-    if (argc < 5) {
-        return RedisModule_WrongArity(ctx);
+/* emit the command creating `td`, TIMER.SADD `setkey` if it's a set member, else TIMER.NEW,
+ * to the AOF being rewritten by `io`, or replicated if `io` is NULL */
+static void emitTimer(RedisModuleCtx *ctx, RedisModuleIO *io, RedisModuleString *setkey, const TimerData *td) {
+    RedisModuleString *tkey = payloadString(ctx, td, PAYLOAD_KEY);
+    RedisModuleString *function = payloadString(ctx, td, PAYLOAD_FUNCTION);
+    RedisModuleString **data = RedisModule_Alloc(sizeof(RedisModuleString*)*(td->datalen+1));
+    payloadData(ctx, td, data);
+    RedisModuleString *opts[TIMER_OPTIONS_ARGC];
+    int nopts = timerOptionsArgv(ctx, td, opts);
+    long long interval = td->interval;
+    if (setkey && io) {
+        RedisModule_EmitAOF(io, "timer.sadd", "ssslvlv", setkey, tkey, function, interval, opts, (size_t)nopts, (long long)td->numkeys, data, (size_t)td->datalen);
+    } else if (setkey) {
+        RedisModule_Replicate(ctx, "timer.sadd", "ssslvlv", setkey, tkey, function, interval, opts, (size_t)nopts, (long long)td->numkeys, data, (size_t)td->datalen);
+    } else if (io) {
+        RedisModule_EmitAOF(io, "timer.new", "sslvlv", tkey, function, interval, opts, (size_t)nopts, (long long)td->numkeys, data, (size_t)td->datalen);
+    } else {
+        RedisModule_Replicate(ctx, "timer.new", "sslvlv", tkey, function, interval, opts, (size_t)nopts, (long long)td->numkeys, data, (size_t)td->datalen);
     }
-    key = argv[1];
-    function = argv[2];
-    if (RedisModule_StringToLongLong(argv[3], &interval) != REDISMODULE_OK || interval <= 0) {
-        return RedisModule_ReplyWithError(ctx, "ERR invalid interval");
+    /* freed right away, a set may emit millions of timers */
+    for (int i = 0; i < td->datalen; i++) {
+        RedisModule_FreeString(ctx, data[i]);
     }
-
-    pos = 4;
-    s = RedisModule_StringPtrLen(argv[pos], NULL);
-    if (strcasecmp(s, "LOOP") == 0) {
-        loop = true;
-        pos++;
+    for (int i = 0; i < nopts; i++) {
+        RedisModule_FreeString(ctx, opts[i]);
     }
-    if (pos >= argc) {
-        return RedisModule_WrongArity(ctx);
+    RedisModule_FreeString(ctx, function);
+    RedisModule_FreeString(ctx, tkey);
+    RedisModule_Free(data);
+}
+
+void timer_AOFRewriteCallBack(RedisModuleIO *io, RedisModuleString *key, void *value) {
+    REDISMODULE_NOT_USED(key);
+    emitTimer(RedisModule_GetContextFromIO(io), io, NULL, value);
+}
+
+size_t timer_MemUsageCallBack(const void *value) {
+    const TimerData *td = value;
+    return sizeof(*td) + td->size;
+}
+
+/* called in main thread whenever the key is removed from db, before the value is freed */
+void timer_UnlinkCallBack(RedisModuleString *key, const void *value) {
+    REDISMODULE_NOT_USED(key);
+    unlinkTimer((TimerData *)value);
+}
+
+/* may be called in lazyfree thread, timers of async flushed db are detached by flushdbCallback */
+void timer_FreeCallBack(void *value) {
+    TimerData *td = (TimerData *)value;
+    if (!td->deleted) {
+        DetachTimerData(td);
     }
-    if (RedisModule_StringToLongLong(argv[pos], &numkeys) != REDISMODULE_OK || numkeys < 0) {
-        return RedisModule_ReplyWithError(ctx, "ERR invalid numkeys");
+    ReleaseTimerData(td);
+}
+
+void *set_RDBLoadCallBack(RedisModuleIO *io, int encver) {
+    if (encver < 1 || encver > SET_ENCODE_VERSION) {
+        RedisModule_LogIOError(io, "warning", "decode failed, rdb ver: %d, my ver: %d", encver, SET_ENCODE_VERSION);
+        return NULL;
     }
-    pos++;
-    datalen = argc - pos;
-    if (datalen < numkeys) {
-        return RedisModule_WrongArity(ctx);
+    TimerSet *set = createTimerSet(RedisModule_GetKeyNameFromIO(io));
+    uint64_t n = RedisModule_LoadUnsigned(io);
+    for (uint64_t i = 0; i < n; i++) {
+        TimerData *td = loadTimer(io, encver + 1, set);
+        if (!td) {
+            set_FreeCallBack(set);
+            return NULL;
+        }
+        size_t len;
+        const char *member = payloadAt(td, PAYLOAD_KEY, &len);
+        RedisModule_DictSetC(set->members, (void *)member, len, td);
     }
-    
-    /* allocate structure and init */
-    td = (TimerData*)RedisModule_Alloc(sizeof(*td)+sizeof(RedisModuleString*)*datalen);
-    timers++;
-    RedisModule_RetainString(ctx, key);
-    td->key = key;
-    RedisModule_RetainString(ctx, function);
-    td->function = function;
-    td->interval = interval;
-    td->loop = loop;
-    
-    for (int i = 0; i < datalen; i++) {
-        RedisModule_RetainString(ctx, argv[pos+i]);
-        td->data[i] = argv[pos+i];
+    if (!loadingOnePass()) {
+        wheelArm(RedisModule_GetContextFromIO(io));
     }
-    td->datalen = datalen;
-    td->numkeys = (int)numkeys;
+    return set;
+}
 
-    /* create the timer through the Timer API */
-    td->tid = RedisModule_CreateTimer(ctx, interval, TimerCallback, td);
-    td->dbid = -1; /* timer' dbid is always the same with key's in this way */
-    td->deleted = false;
-    
-    RedisModuleKey *mk = RedisModule_OpenKey(ctx, key, REDISMODULE_WRITE); /* auto closed */
-    if (RedisModule_ModuleTypeGetType(mk) == moduleType) {
-        old = RedisModule_ModuleTypeGetValue(mk);  // reset timer
+void set_RDBSaveCallBack(RedisModuleIO *io, void *value) {
+    TimerSet *set = value;
+    RedisModule_SaveUnsigned(io, RedisModule_DictSize(set->members));
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(set->members, "^", NULL, 0);
+    TimerData *td;
+    while (RedisModule_DictNextC(iter, NULL, (void **)&td)) {
+        saveTimer(io, td);
     }
-    RedisModule_ModuleTypeSetValue(mk, moduleType, td);
-    if (old) {  // clear asap
-        RedisModule_Assert(old->deleted);
-        RedisModule_StopTimer(ctx, old->tid, NULL);
-        DeleteTimerData(ctx, old);
+    RedisModule_DictIteratorStop(iter);
+}
+
+/* Order set members by everything TIMER.MSADD shares between them: deadline, interval, options, shape of
+ * the data and function, so that members which can be created by one command are adjacent */
+static int timerShapeCompare(const void *a, const void *b) {
+    const TimerData *x = *(const TimerData *const *)a, *y = *(const TimerData *const *)b;
+    int64_t kx[] = {x->expire, x->interval, x->loop, x->rate, x->action, x->numkeys, x->datalen, x->ext & ~(1U << EXT_OWNER | 1U << EXT_HASH),
+                    x->ext & (1U << EXT_SLACK) ? extGet(x, EXT_SLACK) : 0, x->ext & (1U << EXT_MAXLEN) ? extGet(x, EXT_MAXLEN) : 0,
+                    x->ext & (1U << EXT_TIMES) ? extGet(x, EXT_TIMES) : 0, x->ext & (1U << EXT_JITTER) ? extGet(x, EXT_JITTER) : 0};
+    int64_t ky[] = {y->expire, y->interval, y->loop, y->rate, y->action, y->numkeys, y->datalen, y->ext & ~(1U << EXT_OWNER | 1U << EXT_HASH),
+                    y->ext & (1U << EXT_SLACK) ? extGet(y, EXT_SLACK) : 0, y->ext & (1U << EXT_MAXLEN) ? extGet(y, EXT_MAXLEN) : 0,
+                    y->ext & (1U << EXT_TIMES) ? extGet(y, EXT_TIMES) : 0, y->ext & (1U << EXT_JITTER) ? extGet(y, EXT_JITTER) : 0};
+    for (size_t i = 0; i < sizeof(kx)/sizeof(kx[0]); i++) {
+        if (kx[i] != ky[i]) return kx[i] < ky[i] ? -1 : 1;
     }
-    RedisModule_ReplicateVerbatim(ctx);
-    RedisModule_ReplyWithLongLong(ctx, old ? 0 : 1);
-    return REDISMODULE_OK;
+    size_t lx, ly;
+    const char *fx = payloadAt(x, PAYLOAD_FUNCTION, &lx), *fy = payloadAt(y, PAYLOAD_FUNCTION, &ly);
+    if (lx != ly) return lx < ly ? -1 : 1;
+    return memcmp(fx, fy, lx);
 }
 
+/* emit members `tds[0..n)` of the same shape with TIMER.MSADD, AOF_REWRITE_ITEMS_PER_CMD per command */
+static void emitSetMembers(RedisModuleIO *io, RedisModuleString *key, TimerData **tds, size_t n) {
+    RedisModuleCtx *ctx = RedisModule_GetContextFromIO(io);
+    const TimerData *first = tds[0];
+    RedisModuleString *function = payloadString(ctx, first, PAYLOAD_FUNCTION);
+    size_t stride = 1 + first->datalen, head = 0;
+    size_t cap = 1 + TIMER_OPTIONS_ARGC + 2 + stride * AOF_REWRITE_ITEMS_PER_CMD;
+    RedisModuleString **argv = RedisModule_Alloc(sizeof(RedisModuleString*) * cap);
+    argv[head++] = RedisModule_CreateStringFromLongLong(ctx, first->interval);
+    head += timerOptionsArgv(ctx, first, argv + head);
+    argv[head++] = RedisModule_CreateStringFromLongLong(ctx, first->numkeys);
+    argv[head++] = RedisModule_CreateStringFromLongLong(ctx, first->datalen - first->numkeys);
+    for (size_t i = 0; i < n; i += AOF_REWRITE_ITEMS_PER_CMD) {
+        size_t argc = head;
+        for (size_t j = i; j < n && j < i + AOF_REWRITE_ITEMS_PER_CMD; j++) {
+            argv[argc] = payloadString(ctx, tds[j], PAYLOAD_KEY);
+            payloadData(ctx, tds[j], argv + argc + 1);
+            argc += stride;
+        }
+        RedisModule_EmitAOF(io, "timer.msadd", "ssv", key, function, argv, argc);
+        for (size_t j = head; j < argc; j++) {
+            RedisModule_FreeString(ctx, argv[j]);
+        }
+    }
+    for (size_t j = 0; j < head; j++) {
+        RedisModule_FreeString(ctx, argv[j]);
+    }
+    RedisModule_FreeString(ctx, function);
+    RedisModule_Free(argv);
+}
 
-/* Syntax: TIMER.KILL key
-*  Return 1 if a timer been kill, else 0
-*  More effective than DEL key, will clear all the resources
-*/
-int TimerKillCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-    if (argc != 2) {
-        return RedisModule_WrongArity(ctx);
+/* Members sharing deadline, function and options, like the ones added by one TIMER.MSADD, are rewritten
+ * together by TIMER.MSADD, others by TIMER.SADD */
+void set_AOFRewriteCallBack(RedisModuleIO *io, RedisModuleString *key, void *value) {
+    TimerSet *set = value;
+    size_t n = 0, size = RedisModule_DictSize(set->members);
+    TimerData **tds = RedisModule_Alloc(sizeof(TimerData*) * (size ? size : 1));
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(set->members, "^", NULL, 0);
+    while (RedisModule_DictNextC(iter, NULL, (void **)&tds[n])) {
+        n++;
     }
-    if (!RedisModule_KeyExists(ctx, argv[1])) {
-        return RedisModule_ReplyWithLongLong(ctx, 0);
+    RedisModule_DictIteratorStop(iter);
+    qsort(tds, n, sizeof(TimerData*), timerShapeCompare);
+    for (size_t i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && timerShapeCompare(&tds[i], &tds[j]) == 0; j++);
+        if (j - i == 1) {
+            emitTimer(RedisModule_GetContextFromIO(io), io, key, tds[i]);
+        } else {
+            emitSetMembers(io, key, tds + i, j - i);
+        }
     }
+    RedisModule_Free(tds);
+}
 
-    RedisModuleKey *mk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_WRITE); /* auto closed */
-    if (RedisModule_ModuleTypeGetType(mk) != moduleType) {
-        return RedisModule_ReplyWithError(ctx, "ERR wrong type");
+size_t set_MemUsageCallBack(const void *value) {
+    const TimerSet *set = value;
+    size_t size = sizeof(*set);
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(set->members, "^", NULL, 0);
+    TimerData *td;
+    size_t len;
+    while (RedisModule_DictNextC(iter, &len, (void **)&td)) {
+        size += sizeof(*td) + td->size + len;
     }
-    TimerData *td = RedisModule_ModuleTypeGetValue(mk);
-    RedisModule_DeleteKey(mk);
-    RedisModule_Assert(td->deleted);
-    RedisModule_StopTimer(ctx, td->tid, NULL);
-    DeleteTimerData(ctx, td);
-    RedisModule_ReplicateVerbatim(ctx);
-    return RedisModule_ReplyWithLongLong(ctx, 1);
+    RedisModule_DictIteratorStop(iter);
+    return size;
 }
 
-/* Syntax: TIMER.INFO key
-*  Return timer info, remaining is the next fire time interval
-*/
-int TimerInfoCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-    if (argc != 2) {
-        return RedisModule_WrongArity(ctx);
+size_t set_FreeEffortCallBack(RedisModuleString *key, const void *value) {
+    REDISMODULE_NOT_USED(key);
+    return RedisModule_DictSize(((const TimerSet *)value)->members);
+}
+
+void set_UnlinkCallBack(RedisModuleString *key, const void *value) {
+    REDISMODULE_NOT_USED(key);
+    const TimerSet *set = value;
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(set->members, "^", NULL, 0);
+    TimerData *td;
+    while (RedisModule_DictNextC(iter, NULL, (void **)&td)) {
+        unlinkTimer(td);
     }
-    RedisModuleKey *mk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ); /* auto closed */
-    if (RedisModule_ModuleTypeGetType(mk) != moduleType) {
-        if (mk) {
-            return RedisModule_ReplyWithError(ctx, "ERR wrong type");
-        } else {
-            return RedisModule_ReplyWithNull(ctx);
+    RedisModule_DictIteratorStop(iter);
+}
+
+/* may be called in lazyfree thread like timer_FreeCallBack, members are detached by then */
+void set_FreeCallBack(void *value) {
+    TimerSet *set = value;
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(set->members, "^", NULL, 0);
+    TimerData *td;
+    while (RedisModule_DictNextC(iter, NULL, (void **)&td)) {
+        if (!td->deleted) {
+            DetachTimerData(td);
         }
+        ReleaseTimerData(td);
     }
-    TimerData *td = RedisModule_ModuleTypeGetValue(mk);
-    uint64_t remaining = td->interval;
-    RedisModule_GetTimerInfo(ctx, td->tid, &remaining, NULL);
-    RedisModule_ReplyWithMap(ctx, 4+td->datalen);
-    RedisModule_ReplyWithCString(ctx, "function");
-    RedisModule_ReplyWithString(ctx, td->function);
-    RedisModule_ReplyWithCString(ctx, "interval");
-    RedisModule_ReplyWithLongLong(ctx, td->interval);
-    RedisModule_ReplyWithCString(ctx, "remaining");
-    RedisModule_ReplyWithLongLong(ctx, remaining);
-    RedisModule_ReplyWithCString(ctx, "loop");
-    RedisModule_ReplyWithBool(ctx, td->loop);
-    for (int i = 0; i < td->datalen; i++) {
-        const char *fmt = i < td->numkeys ? "key%d" : "arg%d";
-        int index = i<td->numkeys ? i : i-td->numkeys;
-        RedisModuleString *name = RedisModule_CreateStringPrintf(ctx, fmt, index+1);
-        RedisModule_ReplyWithString(ctx, name);
-        RedisModule_ReplyWithString(ctx, td->data[i]);
+    RedisModule_DictIteratorStop(iter);
+    RedisModule_FreeDict(NULL, set->members);
+    RedisModule_FreeString(NULL, set->key);
+    RedisModule_Free(set);
+}
+
+static void detachDbTimers(TimerList *list, int dbnum) {
+    TimerData *next;
+    for (TimerData *td = list->head; td; td = next) {
+        next = td->next;
+        if (dbnum == -1 || td->dbid == dbnum) {
+            DetachTimerData(td);
+        }
     }
-    return REDISMODULE_OK;
 }
 
-void *timer_RDBLoadCallBack(RedisModuleIO *io, int encver) {
-    if (encver != ENCODE_VERSION) {
-        RedisModule_LogIOError(io, "warning", "decode failed, rdb ver: %d, my ver: %d", encver, ENCODE_VERSION);
-        return NULL;
+/* detach the timers of `dbid` (all if -1) from the schedule before the db is emptied,
+ * values of an async flush are freed in lazyfree thread, which must not touch the wheel */
+void flushdbCallback(RedisModuleCtx *ctx, RedisModuleEvent e, uint64_t sub, void *data) {
+    REDISMODULE_NOT_USED(ctx);
+    REDISMODULE_NOT_USED(e);
+    RedisModuleFlushInfo *fi = data;
+    if (sub != REDISMODULE_SUBEVENT_FLUSHDB_START) return;
+    for (int i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++) {
+        detachDbTimers(&wheel.slots[0][0] + i, fi->dbnum);
     }
-    RedisModuleCtx *ctx = RedisModule_GetContextFromIO(io);
-    RedisModule_AutoMemory(ctx);
-    int datalen = (int)RedisModule_LoadSigned(io);
-    TimerData *td = (TimerData*)RedisModule_Alloc(sizeof(*td)+sizeof(RedisModuleString*)*datalen);
-    timers++;
-    td->datalen = datalen;
-    for (int i = 0; i < td->datalen; i++) {
-        td->data[i] = RedisModule_LoadString(io);
+    for (int i = 0; i < dispatcher.dbnum; i++) {
+        detachDbTimers(&dispatcher.ready[i], fi->dbnum);
+    }
+    detachDbTimers(&loading.pending, fi->dbnum);
+    detachDbTimers(&loading.skipped, fi->dbnum);
+    detachDbTimers(&passive.timers, fi->dbnum);
+    detachDbTimers(&limits.global.backlog, fi->dbnum);
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(limits.functions, "^", NULL, 0);
+    RateLimit *limit;
+    while (RedisModule_DictNextC(iter, NULL, (void **)&limit)) {
+        detachDbTimers(&limit->backlog, fi->dbnum);
+    }
+    RedisModule_DictIteratorStop(iter);
+    iter = RedisModule_DictIteratorStartC(breakers, "^", NULL, 0);
+    Breaker *breaker;
+    while (RedisModule_DictNextC(iter, NULL, (void **)&breaker)) {
+        detachDbTimers(&breaker->backlog, fi->dbnum);
+    }
+    RedisModule_DictIteratorStop(iter);
+    for (int dbid = 0; dbid < dispatcher.dbnum; dbid++) {
+        if (fi->dbnum != -1 && dbid != fi->dbnum) continue;
+        RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(poller.queues[dbid], "^", NULL, 0);
+        PollQueue *queue;
+        while (RedisModule_DictNextC(iter, NULL, (void **)&queue)) {
+            while (queue->due.head) {
+                DetachTimerData(queue->due.head);
+            }
+            if (!queue->head && !queue->pending) {
+                /* deleting invalidates the iterator, seek past the freed queue */
+                RedisModule_DictDelC(poller.queues[dbid], queue->name, queue->len, NULL);
+                RedisModule_DictIteratorReseekC(iter, ">", queue->name, queue->len);
+                RedisModule_Free(queue);
+            }
+        }
+        RedisModule_DictIteratorStop(iter);
     }
-    td->key = RedisModule_LoadString(io);
-    td->function = RedisModule_LoadString(io);
-    td->numkeys = (int)RedisModule_LoadSigned(io);
-    td->interval = RedisModule_LoadSigned(io);
-    td->loop = RedisModule_LoadSigned(io) == 1;
-    td->deleted = false;
-    td->tid = RedisModule_CreateTimer(ctx, td->interval, TimerCallback, td);
-    /* see https://github.com/redis/redis/pull/11361 */
-    td->dbid = RedisModule_GetDbIdFromIO(io);
-    return td;
 }
 
-void timer_RDBSaveCallBack(RedisModuleIO *io, void *value) {
-    RedisModuleCtx *ctx = RedisModule_GetContextFromIO(io);
-    RedisModule_AutoMemory(ctx);
-    TimerData *td = value;
-    RedisModule_SaveSigned(io, td->datalen);
-    for (int i = 0; i < td->datalen; i++) {
-        RedisModule_SaveString(io, td->data[i]);
-    }
-    RedisModule_SaveString(io, td->key);
-    RedisModule_SaveString(io, td->function);
-    RedisModule_SaveSigned(io, td->numkeys);
-    uint64_t interval = td->interval;
-    if (!td->loop) {
-        RedisModule_GetTimerInfo(ctx, td->tid, &interval, NULL);
+/* delete the timers skipped by the catch-up, the deletion is replicated like a fired one-time timer */
+static void deleteSkipped(RedisModuleCtx *ctx) {
+    while (loading.skipped.head) {
+        TimerData *td = loading.skipped.head;
+        listRemove(td);
+        RedisModule_SelectDb(ctx, td->dbid);
+        RedisModuleString *key = payloadString(ctx, td, PAYLOAD_KEY);
+        deleteFiredTimer(ctx, td, key);
+        RedisModule_FreeString(ctx, key);
     }
-    RedisModule_SaveSigned(io, interval);
-    RedisModule_SaveSigned(io, td->loop ? 1 : 0);
 }
 
-void timer_AOFRewriteCallBack(RedisModuleIO *io, RedisModuleString *key, void *value) {
-    REDISMODULE_NOT_USED(key);
-    RedisModuleCtx *ctx = RedisModule_GetContextFromIO(io);
-    RedisModule_AutoMemory(ctx);
-    TimerData *td = value;
-    if (td->loop) {
-        RedisModule_EmitAOF(io, "timer.new", "sslclv", td->key, td->function, td->interval, "LOOP", (long long)td->numkeys, td->data, (size_t)td->datalen);
-    } else {
-        uint64_t remaining = td->interval;
-        RedisModule_GetTimerInfo(ctx, td->tid, &remaining, NULL);
-        RedisModule_EmitAOF(io, "timer.new", "ssllv", td->key, td->function, remaining, (long long)td->numkeys, td->data, (size_t)td->datalen);
+/* delete the timers skipped by RESTORE, unless a load started meanwhile, then it deletes them when it ends */
+void RestoredCallback(RedisModuleCtx *ctx, void *data) {
+    REDISMODULE_NOT_USED(data);
+    loading.restored = false;
+    if (!loading.active) {
+        deleteSkipped(ctx);
     }
 }
 
-void timer_FreeCallBack(void *value) {
-    TimerData *td = (TimerData *)value;
-    td->deleted = true; /* we don't have ctx to call StopTimer, so mark it as deleted, will clear it in TimerCallback, sigh */
+/* Loaded timers are scheduled in one pass when loading ends, and the wheel armed once.
+ * Timers skipped while loading are deleted, the deletion is replicated like a fired one-time timer */
+void loadingCallback(RedisModuleCtx *ctx, RedisModuleEvent e, uint64_t sub, void *data) {
+    REDISMODULE_NOT_USED(e);
+    REDISMODULE_NOT_USED(data);
+    if (sub == REDISMODULE_SUBEVENT_LOADING_RDB_START || sub == REDISMODULE_SUBEVENT_LOADING_AOF_START ||
+        sub == REDISMODULE_SUBEVENT_LOADING_REPL_START) {
+        loading.active = true;
+        loading.replica = sub == REDISMODULE_SUBEVENT_LOADING_REPL_START;
+        loading.monotonic = monotonicMs();
+        loading.wallclock = RedisModule_Milliseconds();
+        return;
+    }
+    if (!loading.active) return;
+    loading.active = false;
+    long long loaded = loading.pending.len;
+    long long start = monotonicUs();
+    while (loading.pending.head) {
+        TimerData *td = loading.pending.head;
+        listRemove(td);
+        wheelInsert(td);
+    }
+    wheelArm(ctx);
+    if (loaded) {
+        RedisModule_Log(ctx, "notice", "scheduled %lld loaded timers in %lld us", loaded, monotonicUs() - start);
+    }
+    deleteSkipped(ctx);
 }
 
-/* Module entrypoint */
+/* Module entrypoint
+ * Module arguments are config pairs, e.g. `loadmodule timer.so dispatch-budget 1000` */
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    REDISMODULE_NOT_USED(argv);
-    REDISMODULE_NOT_USED(argc);
     /* Register the module itself */
     if (RedisModule_Init(ctx, "timer", MODULE_VERSION, REDISMODULE_APIVER_1) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
     RedisModule_AutoMemory(ctx);
+    if (argc % 2 != 0) {
+        RedisModule_Log(ctx, "warning", "module arguments should be config pairs");
+        return REDISMODULE_ERR;
+    }
+    for (int i = 0; i < argc; i += 2) {
+        const char *name = RedisModule_StringPtrLen(argv[i], NULL);
+        const char *err;
+        if (setConfig(name, argv[i+1], &err) != REDISMODULE_OK) {
+            RedisModule_Log(ctx, "warning", "%s: %s", err, name);
+            return REDISMODULE_ERR;
+        }
+    }
+    dispatcher.dbnum = 16;
+    RedisModuleCallReply *reply = RedisModule_Call(ctx, "CONFIG", "cc", "GET", "databases");
+    if (RedisModule_CallReplyType(reply) == REDISMODULE_REPLY_ARRAY && RedisModule_CallReplyLength(reply) == 2) {
+        long long dbnum;
+        RedisModuleString *value = RedisModule_CreateStringFromCallReply(RedisModule_CallReplyArrayElement(reply, 1));
+        if (RedisModule_StringToLongLong(value, &dbnum) == REDISMODULE_OK && dbnum > 0) {
+            dispatcher.dbnum = (int)dbnum;
+        }
+    }
+    dispatcher.ready = RedisModule_Calloc(dispatcher.dbnum, sizeof(TimerList));
+    stats.dbs = RedisModule_Calloc(dispatcher.dbnum, sizeof(DbStats));
+    poller.queues = RedisModule_Calloc(dispatcher.dbnum, sizeof(RedisModuleDict*));
+    for (int i = 0; i < dispatcher.dbnum; i++) {
+        poller.queues[i] = RedisModule_CreateDict(NULL);
+    }
+    poller.waiters = RedisModule_CreateDict(NULL);
+    limits.functions = RedisModule_CreateDict(NULL);
+    breakers = RedisModule_CreateDict(NULL);
+    intern.strings = RedisModule_CreateDict(NULL);
+    wheel.now = monotonicMs();
+    stats.sampleTime = wheel.now;
     /* register commands */
     if (RedisModule_CreateCommand(ctx, "timer.new", TimerNewCommand, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
@@ -345,9 +3895,60 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         return REDISMODULE_ERR;
     }
 
+    if (RedisModule_CreateCommand(ctx, "timer.mnew", TimerMNewCommand, "write deny-oom getkeys-api", 0, 0, 0) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "timer.mkill", TimerMKillCommand, "write", 1, -1, 1) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "timer.touch", TimerTouchCommand, "write fast", 1, 1, 1) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "timer.sadd", TimerSAddCommand, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_CreateCommand(ctx, "timer.msadd", TimerMSAddCommand, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "timer.srem", TimerSRemCommand, "write fast", 1, 1, 1) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "timer.scard", TimerSCardCommand, "readonly fast", 1, 1, 1) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "timer.poll", TimerPollCommand, "write", 1, 1, 1) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
     if (RedisModule_CreateCommand(ctx, "timer.info", TimerInfoCommand, "readonly fast", 1, 1, 1) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
+
+    if (RedisModule_CreateCommand(ctx, "timer.stats", TimerStatsCommand, "readonly fast", 0, 0, 0) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "timer.config", TimerConfigCommand, "admin", 0, 0, 0) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "timer.limit", TimerLimitCommand, "admin", 0, 0, 0) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "timer.breaker", TimerBreakerCommand, "admin", 0, 0, 0) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_RegisterInfoFunc(ctx, InfoCallback) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
     
     RedisModuleTypeMethods tm = {
         .version = REDISMODULE_TYPE_METHOD_VERSION,
@@ -355,16 +3956,37 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         .rdb_save = timer_RDBSaveCallBack,
         .aof_rewrite = timer_AOFRewriteCallBack,
         .free = timer_FreeCallBack,
+        .unlink = timer_UnlinkCallBack,
+        .mem_usage = timer_MemUsageCallBack,
     };
     moduleType = RedisModule_CreateDataType(ctx, "timer-tzw", ENCODE_VERSION, &tm);
     if (moduleType == NULL) {
         return REDISMODULE_ERR;
     }
+
+    RedisModuleTypeMethods sm = {
+        .version = REDISMODULE_TYPE_METHOD_VERSION,
+        .rdb_load = set_RDBLoadCallBack,
+        .rdb_save = set_RDBSaveCallBack,
+        .aof_rewrite = set_AOFRewriteCallBack,
+        .free = set_FreeCallBack,
+        .unlink = set_UnlinkCallBack,
+        .mem_usage = set_MemUsageCallBack,
+        .free_effort = set_FreeEffortCallBack,
+    };
+    setType = RedisModule_CreateDataType(ctx, "timer-set", SET_ENCODE_VERSION, &sm);
+    if (setType == NULL) {
+        return REDISMODULE_ERR;
+    }
     
     RedisModule_SubscribeToServerEvent(ctx,
             RedisModuleEvent_ReplicationRoleChanged, roleChangeCallback);
+    RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_FlushDB, flushdbCallback);
+    RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_CronLoop, cronLoopCallback);
+    RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_Loading, loadingCallback);
     isMaster = RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_MASTER;
     RedisModule_Log(ctx, "notice", "role: %s", isMaster ? "master": "slave");
+    applyReplicaMode(ctx);
     
     RedisModule_SubscribeToKeyspaceEvents(ctx, REDISMODULE_NOTIFY_GENERIC, keyEventsCallback);
     return REDISMODULE_OK;
@@ -373,5 +3995,12 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 int RedisModule_OnUnload(RedisModuleCtx *ctx) {
     RedisModule_AutoMemory(ctx);
     // can't unload if have running timers
-    return timers>0 ? REDISMODULE_ERR : REDISMODULE_OK;
+    if (__atomic_load_n(&timers, __ATOMIC_RELAXED) > 0) {
+        return REDISMODULE_ERR;
+    }
+    if (wheel.armed) {
+        RedisModule_StopTimer(ctx, wheel.tid, NULL);
+        wheel.armed = 0;
+    }
+    return REDISMODULE_OK;
 }